@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define _LEXER_IMPL
 #define _LEXER_KEYWORDS \
@@ -17,6 +23,14 @@
   KW_JMP,               \
   KW_JZ,                \
   KW_JNZ,               \
+  KW_LOAD,              \
+  KW_STORE,             \
+  KW_MEMCPY,            \
+  KW_MEMSET,            \
+  KW_CALL,              \
+  KW_RET,               \
+  KW_SPAWN,             \
+  KW_JOIN,              \
   KW_HALT
 #define _LEXER_TOKENIZE_NEWLINE
 #include "lexer.h"
@@ -34,6 +48,14 @@ const token_t KEYWORD_MAP[255] = {
   [_("jmp", 3)] = KW_JMP,
   [_("jz", 2)] = KW_JZ,
   [_("jnz", 3)] = KW_JNZ,
+  [_("load", 4)] = KW_LOAD,
+  [_("store", 5)] = KW_STORE,
+  [_("memcpy", 6)] = KW_MEMCPY,
+  [_("memset", 6)] = KW_MEMSET,
+  [_("call", 4)] = KW_CALL,
+  [_("ret", 3)] = KW_RET,
+  [_("spawn", 5)] = KW_SPAWN,
+  [_("join", 4)] = KW_JOIN,
   [_("halt", 4)] = KW_HALT,
 };
 
@@ -52,11 +74,17 @@ const token_t KEYWORDS[KEYWORD_COUNT] = {_LEXER_KEYWORDS};
 
 #include "vm.h"
 #include "disk.h"
+#include "chunk.h"
+#include "inliner.h"
 
 typedef struct {
   Inst* buffer;
   size_t insts;
   size_t instc;
+  Value *data;
+  size_t datas;
+  size_t datac;
+  size_t memory_size;
 } Ctx;
 
 static inst_t kw_to_inst_t(token_t kw)
@@ -72,13 +100,44 @@ static inst_t kw_to_inst_t(token_t kw)
   else return kw - KW_NOP;
 }
 
+// Field-wise so the padding after `type` is always zero and a source
+// always assembles to the same bytes.
+static void put_inst(Inst *slot, Inst instruction)
+{
+  (void)memset(slot, 0, sizeof *slot);
+  slot->type = instruction.type;
+  slot->operand = instruction.operand;
+}
+
 static void ctx_ins(Ctx *c, Inst instruction)
 {
   if (c->insts == c->instc) {
-    c->buffer = reallocf(c->buffer, c->instc * 2);
+    c->instc *= 2;
+    c->buffer = reallocf(c->buffer, sizeof(Inst) * c->instc);
     if (c->buffer == NULL) exit(1);
   }
-  c->buffer[c->insts++] = instruction;
+  put_inst(&c->buffer[c->insts++], instruction);
+}
+
+static void ctx_data(Ctx *c, Value value)
+{
+  if (c->datas == c->datac) {
+    c->datac = c->datac ? c->datac * 2 : 128;
+    c->data = reallocf(c->data, sizeof(Value) * c->datac);
+    if (c->data == NULL) exit(1);
+  }
+  c->data[c->datas++] = value;
+}
+
+static Ctx ctx_new(void)
+{
+  Ctx c = {
+    .buffer = malloc(128 * sizeof(Inst)),
+    .insts = 0,
+    .instc = 128,
+  };
+  if (c.buffer == NULL) exit(1);
+  return c;
 }
 
 static parse_error_t parse_operand(Parser *p, Value *out)
@@ -119,6 +178,80 @@ static parse_error_t instruction(Ctx *c, Parser *p)
   return PARSE_ERR_NONE;
 }
 
+static bool token_is(Token t, const char *text)
+{
+  return t.length == strlen(text) && memcmp(t.start, text, t.length) == 0;
+}
+
+// `.memory <size>` sets the size of linear memory in values and
+// `.data <value>...` appends initialised values to the start of it.
+static parse_error_t directive(Ctx *c, Parser *p)
+{
+  (void)parse_expect(p, TOKEN_DOT);
+  // Directive names go through the keyword map like any other word, so
+  // match on the text rather than the token type.
+  Token name = parse_advance(p);
+
+  if (token_is(name, "memory")) {
+    Value size;
+    parse_error_t result = parse_operand(p, &size);
+    if (result != PARSE_ERR_NONE) return result;
+    if (size < 0 || (uint64_t)size > PROG_MAX_MEMORY) return PARSE_ERR_UNEXPECTED_TOKEN;
+    c->memory_size = size;
+  } else if (token_is(name, "data")) {
+    while (parse_peek(p).type != TOKEN_NEWLINE &&
+           parse_peek(p).type != TOKEN_EOF) {
+      Value value;
+      parse_error_t result = parse_operand(p, &value);
+      if (result != PARSE_ERR_NONE) return result;
+      if (c->datas == PROG_MAX_MEMORY) return PARSE_ERR_UNEXPECTED_TOKEN;
+      ctx_data(c, value);
+    }
+  } else {
+    return PARSE_ERR_UNEXPECTED_TOKEN;
+  }
+
+  Token term = parse_expect(p, TOKEN_NEWLINE);
+  if (term.type == TOKEN_ERROR) return p->error;
+  return PARSE_ERR_NONE;
+}
+
+static parse_error_t assemble(Ctx *c, const char *source)
+{
+  Lexer lx = lx_new(source);
+  Parser p = {0};
+  p.lx = &lx;
+  for (;;) {
+    token_t next = parse_peek(&p).type;
+    if (next == TOKEN_EOF) return PARSE_ERR_NONE;
+    parse_error_t result = next == TOKEN_DOT
+      ? directive(c, &p)
+      : instruction(c, &p);
+    if (result != PARSE_ERR_NONE) return result;
+  }
+}
+
+// Reads a profile written by `interpreter -p`: one "<ip> <calls>" pair
+// per line, for a build of the same source made with `-fno-inline`.
+static size_t *load_profile(const char *path, size_t count)
+{
+  size_t nread;
+  char *text = (char *)load_bytes_from_disk(path, &nread);
+  size_t *calls = calloc(count, sizeof(size_t));
+  if (calls == NULL) exit(1);
+
+  for (char *cursor = text, *end;; cursor = end) {
+    unsigned long long ip = strtoull(cursor, &end, 10);
+    if (end == cursor) break;
+    cursor = end;
+    unsigned long long hits = strtoull(cursor, &end, 10);
+    if (end == cursor) break;
+    if (ip < count) calls[ip] = hits;
+  }
+  free(text);
+  return calls;
+}
+
 const char *OUT_FILE_EXT = ".ins";
 
 const char *derive_out_path(const char *inpath)
@@ -129,44 +262,370 @@ const char *derive_out_path(const char *inpath)
     if (inpath[i] != '.') continue;
     length = i; break;
   }
-  char *buffer = malloc(length + strlen(OUT_FILE_EXT));
+  char *buffer = malloc(length + strlen(OUT_FILE_EXT) + 1);
   if (buffer == NULL) exit(1);
   (void)memcpy(buffer, inpath, length);
-  (void)memcpy(buffer + length, OUT_FILE_EXT, strlen(OUT_FILE_EXT));
+  (void)memcpy(buffer + length, OUT_FILE_EXT, strlen(OUT_FILE_EXT) + 1);
   return buffer;
 }
 
+#define _ASM_IO_ERROR(msg) \
+  do {                     \
+    errmsg = (msg);        \
+    goto IO_ERROR;         \
+  } while (0)
+
+static inline size_t align_up(size_t value, size_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static char *path_with_suffix(const char *path, const char *suffix)
+{
+  char *buffer = malloc(strlen(path) + strlen(suffix) + 1);
+  if (buffer == NULL) exit(1);
+  (void)strcpy(buffer, path);
+  return strcat(buffer, suffix);
+}
+
+static uint64_t mtime_ns(const struct stat *st)
+{
+  return (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// A byte range of the old output that goes to the new one. Neighbouring
+// chunks that stay neighbours are copied in one go.
+typedef struct {
+  off_t from;
+  off_t to;
+  size_t length;
+} Copy;
+
+static bool copy_range(int in, int out, Copy copy)
+{
+#ifdef __linux__
+  while (copy.length != 0) {
+    ssize_t n = copy_file_range(in, &copy.from, out, &copy.to, copy.length, 0);
+    if (n <= 0) break;
+    copy.length -= n;
+  }
+#endif
+  char buffer[1 << 16];
+  while (copy.length != 0) {
+    const size_t want = copy.length < sizeof buffer ? copy.length : sizeof buffer;
+    const ssize_t n = pread(in, buffer, want, copy.from);
+    if (n <= 0 || pwrite(out, buffer, n, copy.to) != n) return false;
+    copy.from += n;
+    copy.to += n;
+    copy.length -= n;
+  }
+  return true;
+}
+
+static bool copy_queue(int in, int out, Copy *pending, Copy next)
+{
+  if (next.length == 0) return true;
+  if (pending->from + (off_t)pending->length == next.from &&
+      pending->to + (off_t)pending->length == next.to) {
+    pending->length += next.length;
+    return true;
+  }
+  const bool ok = copy_range(in, out, *pending);
+  *pending = next;
+  return ok;
+}
+
+static bool write_at(int fd, const void *bytes, size_t length, off_t offset)
+{
+  for (const char *cursor = bytes; length != 0;) {
+    const ssize_t n = pwrite(fd, cursor, length, offset);
+    if (n <= 0) return false;
+    cursor += n;
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
+// `-i`: rebuilds `output` from `input`, parsing only the chunks (see
+// chunk.h) whose hash is not in the index left by the previous `-i`
+// build. Everything else is copied from the old output, or not touched
+// at all when no chunk moved. Jump operands are relative and the inliner
+// is off, so a chunk assembles to the same code wherever it ends up.
+static int assemble_incremental(const char *input, const char *output)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  fprintf(stderr, "Error: incremental builds need a little-endian host\n");
+  return 1;
+#endif
+  const char *errmsg = NULL;
+  const char *errpath = input;
+
+  const int source_fd = open(input, O_RDONLY);
+  if (source_fd < 0) _ASM_IO_ERROR("could not open file");
+  struct stat st;
+  if (fstat(source_fd, &st) != 0) _ASM_IO_ERROR("while trying to stat file");
+  const size_t size = st.st_size;
+  const char *source = "";
+  if (size != 0) {
+    source = mmap(NULL, size, PROT_READ, MAP_PRIVATE, source_fd, 0);
+    if (source == MAP_FAILED) _ASM_IO_ERROR("while mapping file");
+  }
+
+  // The index only describes the output it was saved with.
+  char *index_path = path_with_suffix(output, ".idx");
+  IndexHeader old_header;
+  ChunkEntry *old = NULL;
+  size_t oldc = 0;
+  const int old_fd = open(output, O_RDONLY);
+  if (old_fd >= 0 && fstat(old_fd, &st) == 0 &&
+      load_index_from_disk(index_path, &old_header, &old) &&
+      old_header.output_size == (uint64_t)st.st_size &&
+      old_header.output_mtime_ns == mtime_ns(&st))
+    oldc = old_header.count;
+
+  size_t capacity = 16;
+  while (capacity < 2 * oldc) capacity *= 2;
+  size_t *table = malloc(sizeof(size_t) * capacity);
+  if (table == NULL) exit(1);
+  for (size_t i = 0; i < capacity; i++) table[i] = SIZE_MAX;
+  for (size_t i = 0; i < oldc; i++) {
+    size_t slot = old[i].hash & (capacity - 1);
+    while (table[slot] != SIZE_MAX) slot = (slot + 1) & (capacity - 1);
+    table[slot] = i;
+  }
+
+  // Find each chunk in the old index, or parse it.
+  size_t chunkc = 0, chunks_capacity = 64;
+  ChunkEntry *chunks = malloc(sizeof(ChunkEntry) * chunks_capacity);
+  size_t *from = malloc(sizeof(size_t) * chunks_capacity);
+  Ctx *parsed = malloc(sizeof(Ctx) * chunks_capacity);
+  if (chunks == NULL || from == NULL || parsed == NULL) exit(1);
+  for (size_t offset = 0, end; offset < size; offset = end, chunkc++) {
+    if (chunkc == chunks_capacity) {
+      chunks_capacity *= 2;
+      chunks = reallocf(chunks, sizeof(ChunkEntry) * chunks_capacity);
+      from = reallocf(from, sizeof(size_t) * chunks_capacity);
+      parsed = reallocf(parsed, sizeof(Ctx) * chunks_capacity);
+      if (chunks == NULL || from == NULL || parsed == NULL) exit(1);
+    }
+    end = chunk_split(source, size, offset);
+    ChunkEntry *chunk = &chunks[chunkc];
+    *chunk = (ChunkEntry){
+      .hash = chunk_hash(source + offset, end - offset),
+      .source_offset = offset,
+      .source_length = end - offset,
+    };
+
+    from[chunkc] = SIZE_MAX;
+    parsed[chunkc] = (Ctx){0};
+    for (size_t slot = chunk->hash & (capacity - 1); table[slot] != SIZE_MAX;
+         slot = (slot + 1) & (capacity - 1)) {
+      const ChunkEntry *match = &old[table[slot]];
+      if (match->hash != chunk->hash || match->source_length != chunk->source_length)
+        continue;
+      from[chunkc] = table[slot];
+      chunk->lines = match->lines;
+      chunk->instc = match->instc;
+      chunk->datac = match->datac;
+      chunk->memory_size = match->memory_size;
+      break;
+    }
+    if (from[chunkc] != SIZE_MAX) continue;
+
+    // The lexer wants a C string.
+    char *text = malloc(end - offset + 1);
+    if (text == NULL) exit(1);
+    (void)memcpy(text, source + offset, end - offset);
+    text[end - offset] = '\0';
+    Ctx *c = &parsed[chunkc];
+    *c = ctx_new();
+    c->memory_size = SIZE_MAX;
+    parse_error_t result = assemble(c, text);
+    if (result != PARSE_ERR_NONE) {
+      printf("ERROR: error while compiling instruction: %u\n", result);
+      return 1;
+    }
+    for (size_t i = 0; i < end - offset; i++) chunk->lines += text[i] == '\n';
+    free(text);
+    chunk->instc = c->insts;
+    chunk->datac = c->datas;
+    chunk->memory_size = c->memory_size == SIZE_MAX ? -1 : (int64_t)c->memory_size;
+  }
+
+  // Lay the output out the way `save_prog_to_disk`/`save_image_to_disk` do.
+  size_t instc = 0, datac = 0, old_instc = 0, old_datac = 0;
+  int64_t memory_size = 0;
+  for (size_t i = 0; i < chunkc; i++) {
+    instc += chunks[i].instc;
+    datac += chunks[i].datac;
+    if (chunks[i].memory_size >= 0) memory_size = chunks[i].memory_size;
+  }
+  for (size_t i = 0; i < oldc; i++) {
+    old_instc += old[i].instc;
+    old_datac += old[i].datac;
+  }
+  const bool image = memory_size != 0 || datac != 0;
+  size_t line = 0, offset = image ? sizeof(ProgHeader) : 0;
+  for (size_t i = 0; i < chunkc; i++) {
+    chunks[i].first_line = line;
+    line += chunks[i].lines;
+    chunks[i].code_offset = offset;
+    offset += sizeof(Inst) * chunks[i].instc;
+  }
+  const ProgHeader header = {
+    .magic = PROG_MAGIC,
+    .count = instc,
+    .memory_size = (size_t)memory_size > datac ? (size_t)memory_size : datac,
+    .datac = datac,
+    .data_offset = datac ? align_up(offset, PROG_DATA_ALIGN) : offset,
+  };
+  offset = header.data_offset;
+  for (size_t i = 0; i < chunkc; i++) {
+    chunks[i].data_offset = offset;
+    offset += sizeof(Value) * chunks[i].datac;
+  }
+
+  // Patch the old output if every chunk kept its place, splice a new one
+  // together otherwise.
+  bool in_place = oldc != 0 && old_instc == instc && old_datac == datac &&
+                  old[0].code_offset == (image ? sizeof(ProgHeader) : 0);
+  for (size_t i = 0; i < chunkc && in_place; i++) {
+    if (from[i] == SIZE_MAX) continue;
+    const ChunkEntry *match = &old[from[i]];
+    in_place = match->code_offset == chunks[i].code_offset &&
+               (match->datac == 0 || match->data_offset == chunks[i].data_offset);
+  }
+
+  char *temp_path = path_with_suffix(output, ".tmp");
+  errpath = in_place ? output : temp_path;
+  const int out = in_place ? open(output, O_WRONLY)
+                           : open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) _ASM_IO_ERROR("could not open file");
+  if (image && !write_at(out, &header, sizeof header, 0))
+    _ASM_IO_ERROR("while writing header");
+
+  // Code first, then data, so copies of neighbouring chunks merge.
+  Copy pending = {0};
+  for (size_t i = 0; i < chunkc; i++) {
+    const ChunkEntry *chunk = &chunks[i];
+    const size_t length = sizeof(Inst) * chunk->instc;
+    if (from[i] == SIZE_MAX) {
+      if (!write_at(out, parsed[i].buffer, length, chunk->code_offset))
+        _ASM_IO_ERROR("while writing code");
+    } else if (!in_place &&
+               !copy_queue(old_fd, out, &pending,
+                           (Copy){old[from[i]].code_offset, chunk->code_offset, length})) {
+      _ASM_IO_ERROR("while copying from the previous build");
+    }
+  }
+  for (size_t i = 0; i < chunkc; i++) {
+    const ChunkEntry *chunk = &chunks[i];
+    const size_t length = sizeof(Value) * chunk->datac;
+    if (from[i] == SIZE_MAX) {
+      if (!write_at(out, parsed[i].data, length, chunk->data_offset))
+        _ASM_IO_ERROR("while writing data segment");
+      free(parsed[i].buffer);
+      free(parsed[i].data);
+    } else if (!in_place &&
+               !copy_queue(old_fd, out, &pending,
+                           (Copy){old[from[i]].data_offset, chunk->data_offset, length})) {
+      _ASM_IO_ERROR("while copying from the previous build");
+    }
+  }
+  if (!copy_range(old_fd, out, pending))
+    _ASM_IO_ERROR("while copying from the previous build");
+  // Covers the padding before an empty data segment.
+  if (!in_place && ftruncate(out, datac ? offset : header.data_offset) != 0)
+    _ASM_IO_ERROR("while sizing output");
+  if (fstat(out, &st) != 0) _ASM_IO_ERROR("while trying to stat file");
+  if (close(out) != 0) _ASM_IO_ERROR("while closing file");
+  if (!in_place && rename(temp_path, output) != 0) _ASM_IO_ERROR("while replacing output");
+
+  const IndexHeader index_header = {
+    .magic = INDEX_MAGIC,
+    .count = chunkc,
+    .output_size = st.st_size,
+    .output_mtime_ns = mtime_ns(&st),
+  };
+  save_index_to_disk(index_path, &index_header, chunks);
+
+  if (old_fd >= 0) (void)close(old_fd);
+  if (size != 0) (void)munmap((void *)source, size);
+  (void)close(source_fd);
+  free(index_path);
+  free(temp_path);
+  free(table);
+  free(old);
+  free(chunks);
+  free(from);
+  free(parsed);
+  return 0;
+
+IO_ERROR:
+  fprintf(stderr, "Error: (operation on %s) %s: %s", errpath, errmsg, strerror(errno));
+  exit(1);
+}
+
+#undef _ASM_IO_ERROR
+
 int main(int argc, const char *argv[])
 {
-  if (argc != 2) {
+  bool inlining = true;
+  bool incremental = false;
+  const char *profile = NULL;
+  const char *input = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-fno-inline") == 0) inlining = false;
+    else if (strcmp(argv[i], "-i") == 0) incremental = true;
+    else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) profile = argv[++i];
+    else if (input == NULL) input = argv[i];
+    else { input = NULL; break; }
+  }
+  if (input == NULL) {
     fprintf(stderr,
             "Error: expected a path to a file\n"
-            "usage: %s <filepath>\n",
-            argv[0]);
+            "usage: %s [-fno-inline] [-p <profile>] <filepath>\n"
+            "       %s -i <filepath>\n",
+            argv[0], argv[0]);
     return 1;
   }
 
+  const char *output = derive_out_path(input);
+  if (incremental) return assemble_incremental(input, output);
+
   size_t nread;
-  const char *source = (char *)load_bytes_from_disk(argv[1], &nread);
-  Lexer lx = lx_new(source);
-  Parser p = {0};
-  p.lx = &lx;
-  Ctx ctx = {
-    .buffer = malloc(128 * sizeof(Inst)),
-    .insts = 0,
-    .instc = 128,
-  };
+  const char *source = (char *)load_bytes_from_disk(input, &nread);
+  Ctx ctx = ctx_new();
+  parse_error_t result = assemble(&ctx, source);
+  if (result != PARSE_ERR_NONE) {
+    printf("ERROR: error while compiling instruction: %u\n", result);
+    return 1;
+  }
 
-  for (;;) {
-    if (parse_peek(&p).type == TOKEN_EOF) break;
-    parse_error_t result = instruction(&ctx, &p);
-    if (result != PARSE_ERR_NONE) {
-      printf("ERROR: error while compiling instruction: %u\n", result);
-      return 1;
-    }
+  if (inlining) {
+    size_t *calls = profile ? load_profile(profile, ctx.insts) : NULL;
+    size_t count;
+    Inst *inlined = inline_calls(ctx.buffer, ctx.insts, calls, &count);
+    free(calls);
+    free(ctx.buffer);
+    ctx.buffer = inlined;
+    ctx.insts = count;
+    ctx.instc = count + 1;
   }
 
-  const char *output = derive_out_path(argv[1]);
-  save_prog_to_disk(output, ctx.buffer, ctx.insts);
+  if (ctx.memory_size == 0 && ctx.datas == 0) {
+    save_prog_to_disk(output, ctx.buffer, ctx.insts);
+    return 0;
+  }
+
+  Prog prog = {
+    .code = ctx.buffer,
+    .count = ctx.insts,
+    .memory = ctx.data,
+    .memory_size = ctx.memory_size > ctx.datas ? ctx.memory_size : ctx.datas,
+    .datac = ctx.datas,
+  };
+  save_image_to_disk(output, &prog);
   return 0;
 }
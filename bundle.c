@@ -0,0 +1,368 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+#include "disk.h"
+#include "verify.h"
+#include "vm.h"
+
+#define __BSWAP_ON __ORDER_BIG_ENDIAN__
+
+// Bundles are little-endian. Big-endian hosts cannot use them in place, so
+// they keep swapped copies of the header, the index and the code of every
+// loaded program; data segments are swapped by `map_memory`.
+#if __BYTE_ORDER__ == __BSWAP_ON
+static void _bswap_header_in_place(BundleHeader *header)
+{
+  header->magic = __builtin_bswap32(header->magic);
+  header->count = __builtin_bswap64(header->count);
+  header->index_offset = __builtin_bswap64(header->index_offset);
+  header->names_offset = __builtin_bswap64(header->names_offset);
+  header->names_size = __builtin_bswap64(header->names_size);
+}
+
+static void _bswap_entry_in_place(BundleEntry *entry)
+{
+  entry->hash = __builtin_bswap64(entry->hash);
+  entry->name_offset = __builtin_bswap64(entry->name_offset);
+  entry->name_length = __builtin_bswap64(entry->name_length);
+  entry->code_offset = __builtin_bswap64(entry->code_offset);
+  entry->count = __builtin_bswap64(entry->count);
+  entry->max_depth = __builtin_bswap64(entry->max_depth);
+  entry->memory_size = __builtin_bswap64(entry->memory_size);
+  entry->data_offset = __builtin_bswap64(entry->data_offset);
+  entry->datac = __builtin_bswap64(entry->datac);
+}
+
+static void _bswap_inst_in_place(Inst *inst)
+{
+  inst->type = __builtin_bswap32(inst->type);
+  inst->operand = __builtin_bswap64(inst->operand);
+}
+#endif
+
+static bool _write_code(FILE *file, const Inst *code, size_t count)
+{
+#if __BYTE_ORDER__ == __BSWAP_ON
+  for (size_t i = 0; i < count; i++) {
+    Inst inst = code[i];
+    _bswap_inst_in_place(&inst);
+    if (fwrite(&inst, sizeof inst, 1, file) != 1) return false;
+  }
+  return true;
+#else
+  return fwrite(code, sizeof(Inst), count, file) == count;
+#endif
+}
+
+static bool _write_values(FILE *file, const Value *values, size_t count)
+{
+#if __BYTE_ORDER__ == __BSWAP_ON
+  for (size_t i = 0; i < count; i++) {
+    const Value value = __builtin_bswap64(values[i]);
+    if (fwrite(&value, sizeof value, 1, file) != 1) return false;
+  }
+  return true;
+#else
+  return fwrite(values, sizeof(Value), count, file) == count;
+#endif
+}
+
+#define _BUNDLE_IO_ERROR(msg) \
+  do {                        \
+    errmsg = (msg);           \
+    goto IO_ERROR;            \
+  } while (0)
+
+static inline size_t _align_up(size_t value, size_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// FNV-1a
+uint64_t bundle_hash(const char *bytes, size_t length)
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)bytes[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+typedef struct {
+  BundleEntry entry;
+  const char *name;
+  const Prog *prog;
+} _PendingEntry;
+
+static int _entry_cmp(const void *a_, const void *b_)
+{
+  const _PendingEntry *a = a_, *b = b_;
+  if (a->entry.hash != b->entry.hash) return a->entry.hash < b->entry.hash ? -1 : 1;
+  return strcmp(a->name, b->name);
+}
+
+static uint64_t _max_depth(const Prog *prog)
+{
+  if (prog->count == 0) return BUNDLE_DEPTH_UNKNOWN;
+  size_t *depths = malloc(sizeof(size_t) * prog->count);
+  if (depths == NULL) exit(1);
+  size_t max_depth;
+  bool verified = verify_prog(prog->code, prog->count, 0, 0,
+                              depths, &max_depth);
+  free(depths);
+  return verified ? max_depth : BUNDLE_DEPTH_UNKNOWN;
+}
+
+void save_bundle_to_disk(const char *path, const char *const *names,
+                         const Prog *progs, size_t count)
+{
+  const char *errmsg = NULL;
+  FILE *file = NULL;
+
+  _PendingEntry *pending = malloc(sizeof(_PendingEntry) * (count + 1));
+  if (pending == NULL) exit(1);
+  size_t names_size = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (progs[i].count == 0) {
+      fprintf(stderr, "Error: program %s has no code\n", names[i]);
+      exit(1);
+    }
+    const size_t length = strlen(names[i]);
+    pending[i] = (_PendingEntry){
+      .entry = {
+        .hash = bundle_hash(names[i], length),
+        .name_length = length,
+        .count = progs[i].count,
+        .max_depth = _max_depth(&progs[i]),
+        .memory_size = progs[i].memory_size,
+        .datac = progs[i].datac,
+      },
+      .name = names[i],
+      .prog = &progs[i],
+    };
+    names_size += length;
+  }
+  qsort(pending, count, sizeof(_PendingEntry), _entry_cmp);
+
+  BundleHeader header = {
+    .magic = BUNDLE_MAGIC,
+    .count = count,
+    .index_offset = sizeof(BundleHeader),
+    .names_offset = sizeof(BundleHeader) + sizeof(BundleEntry) * count,
+    .names_size = names_size,
+  };
+  size_t offset = header.names_offset + names_size;
+  size_t name_offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    BundleEntry *entry = &pending[i].entry;
+    if (i != 0 && _entry_cmp(&pending[i - 1], &pending[i]) == 0) {
+      fprintf(stderr, "Error: duplicate program name %s\n", pending[i].name);
+      exit(1);
+    }
+    entry->name_offset = name_offset;
+    name_offset += entry->name_length;
+    offset = _align_up(offset, BUNDLE_CODE_ALIGN);
+    entry->code_offset = offset;
+    offset += sizeof(Inst) * entry->count;
+  }
+  for (size_t i = 0; i < count; i++) {
+    BundleEntry *entry = &pending[i].entry;
+    if (entry->datac == 0) continue;
+    offset = _align_up(offset, PROG_DATA_ALIGN);
+    entry->data_offset = offset;
+    offset += sizeof(Value) * entry->datac;
+  }
+
+  file = fopen(path, "wb");
+  if (file == NULL) _BUNDLE_IO_ERROR("could not open file");
+#if __BYTE_ORDER__ == __BSWAP_ON
+  _bswap_header_in_place(&header);
+#endif
+  if (fwrite(&header, sizeof header, 1, file) != 1)
+    _BUNDLE_IO_ERROR("while writing header");
+  for (size_t i = 0; i < count; i++) {
+    BundleEntry entry = pending[i].entry;
+#if __BYTE_ORDER__ == __BSWAP_ON
+    _bswap_entry_in_place(&entry);
+#endif
+    if (fwrite(&entry, sizeof entry, 1, file) != 1)
+      _BUNDLE_IO_ERROR("while writing index");
+  }
+  for (size_t i = 0; i < count; i++)
+    if (fwrite(pending[i].name, 1, pending[i].entry.name_length, file) !=
+        pending[i].entry.name_length)
+      _BUNDLE_IO_ERROR("while writing names");
+  // Padding is left as holes by seeking past the end of the file.
+  for (size_t i = 0; i < count; i++) {
+    const BundleEntry *entry = &pending[i].entry;
+    if (fseek(file, entry->code_offset, SEEK_SET) != 0 ||
+        !_write_code(file, pending[i].prog->code, entry->count))
+      _BUNDLE_IO_ERROR("while writing code");
+  }
+  for (size_t i = 0; i < count; i++) {
+    const BundleEntry *entry = &pending[i].entry;
+    if (entry->datac == 0) continue;
+    if (fseek(file, entry->data_offset, SEEK_SET) != 0 ||
+        !_write_values(file, pending[i].prog->memory, entry->datac))
+      _BUNDLE_IO_ERROR("while writing data segment");
+  }
+  if (fclose(file) != 0) _BUNDLE_IO_ERROR("while closing file");
+  free(pending);
+  return;
+
+IO_ERROR:
+  fprintf(stderr, "Error: (operation on %s) %s: %s", path, errmsg, strerror(errno));
+  exit(1);
+}
+
+static bool _range_ok(size_t size, uint64_t offset, uint64_t length, size_t unit)
+{
+  return offset <= size && length <= (size - offset) / unit;
+}
+
+void bundle_open(const char *path, Bundle *out)
+{
+  const char *errmsg = NULL;
+  *out = (Bundle){.fd = -1};
+
+  out->fd = open(path, O_RDONLY);
+  if (out->fd < 0) _BUNDLE_IO_ERROR("could not open file");
+  struct stat st;
+  if (fstat(out->fd, &st) != 0) _BUNDLE_IO_ERROR("while trying to stat file");
+  out->size = st.st_size;
+  errno = EINVAL;
+  if (out->size < sizeof(BundleHeader)) _BUNDLE_IO_ERROR("malformed bundle");
+
+  void *base = mmap(NULL, out->size, PROT_READ, MAP_SHARED, out->fd, 0);
+  if (base == MAP_FAILED) _BUNDLE_IO_ERROR("while mapping bundle");
+  out->base = base;
+#if __BYTE_ORDER__ == __BSWAP_ON
+  BundleHeader *swapped = malloc(sizeof *swapped);
+  if (swapped == NULL) exit(1);
+  (void)memcpy(swapped, base, sizeof *swapped);
+  _bswap_header_in_place(swapped);
+  out->header = swapped;
+#else
+  out->header = base;
+#endif
+
+  const BundleHeader *header = out->header;
+  errno = EINVAL;
+  if (header->magic != BUNDLE_MAGIC ||
+      header->index_offset % sizeof(uint64_t) != 0 ||
+      !_range_ok(out->size, header->index_offset, header->count, sizeof(BundleEntry)) ||
+      !_range_ok(out->size, header->names_offset, header->names_size, 1))
+    _BUNDLE_IO_ERROR("malformed bundle");
+#if __BYTE_ORDER__ == __BSWAP_ON
+  BundleEntry *entries = malloc(sizeof(BundleEntry) * header->count + 1);
+  if (entries == NULL) exit(1);
+  (void)memcpy(entries, out->base + header->index_offset,
+               sizeof(BundleEntry) * header->count);
+  for (size_t i = 0; i < header->count; i++) _bswap_entry_in_place(&entries[i]);
+  out->entries = entries;
+#else
+  out->entries = (const BundleEntry *)(out->base + header->index_offset);
+#endif
+  out->names = (const char *)(out->base + header->names_offset);
+
+  for (size_t i = 0; i < header->count; i++) {
+    const BundleEntry *entry = &out->entries[i];
+    if (!_range_ok(header->names_size, entry->name_offset, entry->name_length, 1) ||
+        entry->code_offset % BUNDLE_CODE_ALIGN != 0 ||
+        !_range_ok(out->size, entry->code_offset, entry->count, sizeof(Inst)) ||
+        entry->count == 0 ||
+        entry->memory_size > PROG_MAX_MEMORY ||
+        entry->datac > entry->memory_size ||
+        (entry->datac != 0 &&
+         !_range_ok(out->size, entry->data_offset, entry->datac, sizeof(Value))))
+      _BUNDLE_IO_ERROR("malformed bundle entry");
+  }
+  return;
+
+IO_ERROR:
+  fprintf(stderr, "Error: (operation on %s) %s: %s", path, errmsg, strerror(errno));
+  exit(1);
+}
+
+void bundle_close(Bundle *bundle)
+{
+#if __BYTE_ORDER__ == __BSWAP_ON
+  free((void *)bundle->header);
+  free((void *)bundle->entries);
+#endif
+  if (bundle->base != NULL) (void)munmap((void *)bundle->base, bundle->size);
+  if (bundle->fd >= 0) (void)close(bundle->fd);
+  *bundle = (Bundle){.fd = -1};
+}
+
+const BundleEntry *bundle_find(const Bundle *bundle, const char *name)
+{
+  const size_t length = strlen(name);
+  const uint64_t hash = bundle_hash(name, length);
+
+  size_t lo = 0, hi = bundle->header->count;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (bundle->entries[mid].hash < hash) lo = mid + 1;
+    else hi = mid;
+  }
+  for (; lo < bundle->header->count && bundle->entries[lo].hash == hash; lo++) {
+    const BundleEntry *entry = &bundle->entries[lo];
+    if (entry->name_length == length &&
+        memcmp(bundle->names + entry->name_offset, name, length) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+void bundle_load(const Bundle *bundle, const BundleEntry *entry, Prog *out)
+{
+  *out = (Prog){.count = entry->count};
+#if __BYTE_ORDER__ == __BSWAP_ON
+  out->code = malloc(sizeof(Inst) * entry->count);
+  if (out->code == NULL) exit(1);
+  (void)memcpy(out->code, bundle->base + entry->code_offset, sizeof(Inst) * entry->count);
+  for (size_t i = 0; i < entry->count; i++) _bswap_inst_in_place(&out->code[i]);
+#else
+  out->code = (Inst *)(bundle->base + entry->code_offset);
+#endif
+  if (entry->memory_size == 0) return;
+
+  const ProgHeader header = {
+    .magic = PROG_MAGIC,
+    .count = entry->count,
+    .memory_size = entry->memory_size,
+    .datac = entry->datac,
+    .data_offset = entry->data_offset,
+  };
+  out->memory = map_memory(bundle->fd, &header);
+  if (out->memory == NULL) {
+    fprintf(stderr, "Error: while mapping linear memory: %s", strerror(errno));
+    exit(1);
+  }
+  out->memory_size = entry->memory_size;
+  out->datac = entry->datac;
+}
+
+void bundle_release(Prog *prog)
+{
+#if __BYTE_ORDER__ == __BSWAP_ON
+  free(prog->code);
+#endif
+  unmap_memory(prog->memory, prog->memory_size);
+  *prog = (Prog){0};
+}
+
+#undef _BUNDLE_IO_ERROR
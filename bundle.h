@@ -0,0 +1,260 @@
+#ifndef _BUNDLE_H
+#define _BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk.h"
+#include "vm.h"
+
+// A bundle packs many programs into one file that is mapped once:
+//
+//   BundleHeader
+//   BundleEntry[count]   sorted by (hash, name)
+//   names                not NUL-terminated
+//   code sections        each aligned to BUNDLE_CODE_ALIGN
+//   data segments        each aligned to PROG_DATA_ALIGN
+//
+// Looking a program up is a binary search over the mapped index and does
+// not touch the file system; code runs from its first instruction and,
+// on little-endian hosts, in place. `bundle_open` checks every entry, including its code
+// and memory size, before any of them can be run.
+#define BUNDLE_MAGIC 0x32425653 // "SVB2"
+#define BUNDLE_CODE_ALIGN 64
+#define BUNDLE_DEPTH_UNKNOWN UINT64_MAX
+
+typedef struct {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t index_offset;
+  uint64_t names_offset;
+  uint64_t names_size;
+} BundleHeader;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t name_offset; // relative to `names_offset`
+  uint64_t name_length;
+  uint64_t code_offset;
+  uint64_t count;
+  uint64_t max_depth;   // BUNDLE_DEPTH_UNKNOWN unless the program verifies
+  uint64_t memory_size;
+  uint64_t data_offset;
+  uint64_t datac;
+} BundleEntry;
+
+typedef struct {
+  int fd;
+  const uint8_t *base;
+  size_t size;
+  const BundleHeader *header;
+  const BundleEntry *entries;
+  const char *names;
+} Bundle;
+
+uint64_t bundle_hash(const char *bytes, size_t length);
+void save_bundle_to_disk(const char *path, const char *const *names,
+                         const Prog *progs, size_t count);
+void bundle_open(const char *path, Bundle *out);
+void bundle_close(Bundle *bundle);
+const BundleEntry *bundle_find(const Bundle *bundle, const char *name);
+// The code of the returned program points into the bundle; release it with
+// `bundle_release` rather than `free_image`.
+void bundle_load(const Bundle *bundle, const BundleEntry *entry, Prog *out);
+void bundle_release(Prog *prog);
+
+#endif // _BUNDLE_H
+
+#ifdef _TEST_IMPL
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test.h"
+
+// Runs `fn(path)` in a child and tells whether it exited with status 1,
+// which is how the bundle functions report bad input.
+static bool _bundle_fails(void (*fn)(const char *), const char *path)
+{
+  // Or the child prints the runner's buffered output again on exit.
+  (void)fflush(stdout);
+  const pid_t pid = fork();
+  if (pid == 0) {
+    (void)freopen("/dev/null", "w", stderr);
+    fn(path);
+    _exit(0);
+  }
+  int status;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 1;
+}
+
+static void _bundle_open_and_close(const char *path)
+{
+  Bundle bundle;
+  bundle_open(path, &bundle);
+  bundle_close(&bundle);
+}
+
+static Value _bundle_test_data[] = { 41, 42, 43 };
+
+// "alpha" (2 instructions), "beta" (3) and "gamma" (3, with a data
+// segment).
+static void _save_test_bundle(const char *path)
+{
+  Inst alpha[] = { inst_push(1), inst_halt };
+  Inst beta[] = { inst_push(2), inst_push(3), inst_halt };
+  Inst gamma[] = { inst_push(0), inst_load, inst_halt };
+  const char *names[] = { "beta", "gamma", "alpha" };
+  const Prog progs[] = {
+    {.code = beta, .count = 3},
+    {.code = gamma, .count = 3, .memory = _bundle_test_data,
+     .memory_size = 100, .datac = 3},
+    {.code = alpha, .count = 2},
+  };
+  save_bundle_to_disk(path, names, progs, 3);
+}
+
+static void _save_duplicate_bundle(const char *path)
+{
+  Inst code[] = { inst_push(1), inst_halt };
+  const char *names[] = { "same", "other", "same" };
+  const Prog progs[] = {
+    {.code = code, .count = 2},
+    {.code = code, .count = 2},
+    {.code = code, .count = 1},
+  };
+  save_bundle_to_disk(path, names, progs, 3);
+}
+
+static void _save_empty_bundle(const char *path)
+{
+  Inst code[] = { inst_halt };
+  const char *names[] = { "empty" };
+  const Prog progs[] = { {.code = code, .count = 0} };
+  save_bundle_to_disk(path, names, progs, 1);
+}
+
+test(bundle_round_trip) {
+  char path[] = "/tmp/bundle_test_XXXXXX";
+  const int fd = mkstemp(path);
+  t_assert(fd >= 0);
+  (void)close(fd);
+  _save_test_bundle(path);
+
+  Bundle bundle;
+  bundle_open(path, &bundle);
+  t_asserteq(bundle.header->count, 3);
+  for (size_t i = 1; i < 3; i++)
+    t_assert(bundle.entries[i - 1].hash <= bundle.entries[i].hash);
+  t_assert(bundle_find(&bundle, "delta") == NULL);
+  t_assert(bundle_find(&bundle, "alph") == NULL);
+  t_assert(bundle_find(&bundle, "") == NULL);
+
+  Prog prog;
+  const BundleEntry *beta = bundle_find(&bundle, "beta");
+  t_assert(beta != NULL);
+  bundle_load(&bundle, beta, &prog);
+  t_asserteq(prog.count, 3);
+  t_asserteq(prog.code[1].operand, 3);
+  t_assert(prog.memory == NULL);
+  t_asserteq(beta->max_depth, 2);
+  bundle_release(&prog);
+
+  const BundleEntry *gamma = bundle_find(&bundle, "gamma");
+  t_assert(gamma != NULL);
+  t_asserteq(gamma->code_offset % BUNDLE_CODE_ALIGN, 0);
+  t_asserteq(gamma->data_offset % PROG_DATA_ALIGN, 0);
+  t_asserteq(gamma->max_depth, 1);
+  bundle_load(&bundle, gamma, &prog);
+  t_asserteq(prog.memory_size, 100);
+  t_asserteq(prog.datac, 3);
+  for (size_t i = 0; i < 3; i++) t_asserteq(prog.memory[i], _bundle_test_data[i]);
+  for (size_t i = 3; i < 100; i++) t_asserteq(prog.memory[i], 0);
+  t_asserteq(prog.code[1].type, INST_LOAD);
+  bundle_release(&prog);
+
+  const BundleEntry *alpha = bundle_find(&bundle, "alpha");
+  t_assert(alpha != NULL);
+  t_asserteq(alpha->count, 2);
+  bundle_close(&bundle);
+  (void)unlink(path);
+}
+
+// Rewrites entry `i` of the bundle at `path` with `patch` applied.
+static void _patch_bundle_entry(const char *path, size_t i, void (*patch)(BundleEntry *))
+{
+  size_t size;
+  uint8_t *bytes = load_bytes_from_disk(path, &size);
+  BundleEntry *entries = (BundleEntry *)(bytes + sizeof(BundleHeader));
+  patch(&entries[i]);
+  save_bytes_to_disk(path, bytes, size);
+  free(bytes);
+}
+
+static void _patch_no_code(BundleEntry *entry) { entry->count = 0; }
+static void _patch_far_code(BundleEntry *entry) { entry->code_offset = (uint64_t)1 << 40; }
+static void _patch_huge_memory(BundleEntry *entry) { entry->memory_size = ((uint64_t)1 << 61) + 1; }
+static void _patch_data_past_memory(BundleEntry *entry) { entry->datac = entry->memory_size + 1; }
+
+test(bundle_rejects_bad_entries) {
+  char path[] = "/tmp/bundle_test_XXXXXX";
+  const int fd = mkstemp(path);
+  t_assert(fd >= 0);
+  (void)close(fd);
+
+  void (*patches[])(BundleEntry *) = {
+    _patch_no_code, _patch_far_code, _patch_huge_memory, _patch_data_past_memory,
+  };
+  for (size_t i = 0; i < sizeof patches / sizeof patches[0]; i++) {
+    _save_test_bundle(path);
+    t_assert(!_bundle_fails(_bundle_open_and_close, path));
+    _patch_bundle_entry(path, 2, patches[i]);
+    t_assert(_bundle_fails(_bundle_open_and_close, path));
+  }
+  t_assert(_bundle_fails(_save_duplicate_bundle, path));
+  t_assert(_bundle_fails(_save_empty_bundle, path));
+  (void)unlink(path);
+}
+
+test(bundle_find_with_equal_hashes) {
+  char path[] = "/tmp/bundle_test_XXXXXX";
+  const int fd = mkstemp(path);
+  t_assert(fd >= 0);
+  (void)close(fd);
+  _save_test_bundle(path);
+
+  // Give every entry the hash of "gamma" and order them by name, as two
+  // colliding names would be; the lookup has to go by the name.
+  size_t size;
+  uint8_t *bytes = load_bytes_from_disk(path, &size);
+  BundleEntry *entries = (BundleEntry *)(bytes + sizeof(BundleHeader));
+  const char *names = (const char *)(bytes + ((BundleHeader *)bytes)->names_offset);
+  const uint64_t hash = bundle_hash("gamma", 5);
+  for (size_t i = 0; i < 3; i++) entries[i].hash = hash;
+  for (size_t i = 0; i < 3; i++)
+    for (size_t j = i + 1; j < 3; j++) {
+      const BundleEntry *a = &entries[i], *b = &entries[j];
+      const size_t length = a->name_length < b->name_length ? a->name_length : b->name_length;
+      const int order = memcmp(names + a->name_offset, names + b->name_offset, length);
+      if (order > 0 || (order == 0 && a->name_length > b->name_length)) {
+        const BundleEntry swap = entries[i];
+        entries[i] = entries[j];
+        entries[j] = swap;
+      }
+    }
+  save_bytes_to_disk(path, bytes, size);
+  free(bytes);
+
+  Bundle bundle;
+  bundle_open(path, &bundle);
+  const BundleEntry *gamma = bundle_find(&bundle, "gamma");
+  t_assert(gamma == &bundle.entries[2]);
+  t_asserteq(gamma->datac, 3);
+  t_assert(bundle_find(&bundle, "alpha") == NULL);
+  bundle_close(&bundle);
+  (void)unlink(path);
+}
+#endif
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+#include "disk.h"
+#include "loader.h"
+
+// A program is named after its file, without directories or extension.
+static char *program_name(const char *path)
+{
+  const char *start = strrchr(path, '/');
+  start = start ? start + 1 : path;
+  const char *end = strrchr(start, '.');
+  size_t length = end ? (size_t)(end - start) : strlen(start);
+  char *name = malloc(length + 1);
+  if (name == NULL) exit(1);
+  (void)memcpy(name, start, length);
+  name[length] = '\0';
+  return name;
+}
+
+int main(int argc, const char *argv[])
+{
+  if (argc < 3) {
+    fprintf(stderr,
+            "Error: expected an output path and at least one program\n"
+            "usage: %s <bundle> <program.ins>...\n",
+            argv[0]);
+    return 1;
+  }
+
+  const size_t count = argc - 2;
+  const char *const *paths = argv + 2;
+  LoadBatch batch;
+  load_batch(paths, count, LOAD_DEFAULT, &batch);
+  for (size_t i = 0; i < count; i++)
+    if (batch.results[i].error != 0)
+      fprintf(stderr, "Error: (operation on %s) could not load program: %s\n",
+              paths[i], strerror(batch.results[i].error));
+  if (batch.failed != 0) return 1;
+
+  char **names = malloc(sizeof(char *) * count);
+  Prog *progs = malloc(sizeof(Prog) * count);
+  if (names == NULL || progs == NULL) exit(1);
+  for (size_t i = 0; i < count; i++) {
+    names[i] = program_name(paths[i]);
+    progs[i] = batch.results[i].prog;
+  }
+
+  save_bundle_to_disk(argv[1], (const char *const *)names, progs, count);
+  return 0;
+}
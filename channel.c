@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "channel.h"
+#include "vm.h"
+
+static bool _map(int fd, size_t size, Channel *out)
+{
+  void *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED) return false;
+  *out = (Channel){.header = header, .size = size, .fd = fd};
+  return true;
+}
+
+bool channel_create(const char *name, size_t capacity, Channel *out)
+{
+  *out = (Channel){.fd = -1};
+  size_t ring = CHANNEL_MIN_CAPACITY;
+  while (ring < capacity) ring *= 2;
+  const size_t size = sizeof(ChannelHeader) + ring;
+
+  int fd;
+  if (name != NULL) {
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  } else {
+#ifdef __linux__
+    fd = memfd_create("stackvm-results", 0);
+#else
+    errno = ENOSYS;
+    fd = -1;
+#endif
+  }
+  if (fd < 0) return false;
+  if (ftruncate(fd, size) != 0 || !_map(fd, size, out)) {
+    (void)close(fd);
+    return false;
+  }
+
+  ChannelHeader *header = out->header;
+  header->capacity = ring;
+  atomic_init(&header->head, 0);
+  atomic_init(&header->tail, 0);
+  header->magic = CHANNEL_MAGIC;
+  return true;
+}
+
+bool channel_open(const char *name, Channel *out)
+{
+  *out = (Channel){.fd = -1};
+  char *end;
+  const long number = strtol(name, &end, 10);
+  const bool inherited = *name != '\0' && *end == '\0';
+  const int fd = inherited ? (int)number : shm_open(name, O_RDWR, 0);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) goto FAIL;
+  errno = EINVAL;
+  if ((size_t)st.st_size < sizeof(ChannelHeader) || !_map(fd, st.st_size, out))
+    goto FAIL;
+  const ChannelHeader *header = out->header;
+  if (header->magic != CHANNEL_MAGIC || header->capacity == 0 ||
+      (header->capacity & (header->capacity - 1)) != 0 ||
+      header->capacity > out->size - sizeof(ChannelHeader)) {
+    (void)munmap(out->header, out->size);
+    goto FAIL;
+  }
+  // Pick up wherever the previous producer or consumer left off.
+  out->head = atomic_load_explicit(&out->header->head, memory_order_acquire);
+  out->tail = atomic_load_explicit(&out->header->tail, memory_order_acquire);
+  return true;
+
+FAIL:
+  if (!inherited) (void)close(fd);
+  *out = (Channel){.fd = -1};
+  return false;
+}
+
+void channel_close(Channel *channel)
+{
+  if (channel->header != NULL) (void)munmap(channel->header, channel->size);
+  if (channel->fd >= 0) (void)close(channel->fd);
+  *channel = (Channel){.fd = -1};
+}
+
+// Spins briefly, then yields, then sleeps, so a side that waits long
+// stops burning a core.
+static void _backoff(unsigned *spins)
+{
+  if (++*spins < 64) return;
+  if (*spins < 128) {
+    (void)sched_yield();
+    return;
+  }
+  const struct timespec pause = {.tv_nsec = 50000};
+  (void)nanosleep(&pause, NULL);
+}
+
+bool channel_push(Channel *channel, uint64_t tag, vm_err_t error,
+                  const Value *values, size_t count)
+{
+  ChannelHeader *header = channel->header;
+  const uint64_t capacity = header->capacity;
+  if (count > (capacity - sizeof(ChannelRecord)) / sizeof(Value)) return false;
+  const uint64_t size = sizeof(ChannelRecord) + sizeof(Value) * count;
+
+  // Waits until `bytes` more fit behind what the consumer still holds.
+#define _WAIT_FOR_ROOM(bytes)                                                     \
+  for (unsigned spins = 0; channel->head + (bytes) - channel->tail > capacity;) { \
+    channel->tail = atomic_load_explicit(&header->tail, memory_order_acquire);    \
+    if (channel->head + (bytes) - channel->tail > capacity) _backoff(&spins);     \
+  }
+
+  // The gap is published on its own; with the record it may not fit at all.
+  const uint64_t offset = channel->head & (capacity - 1);
+  if (capacity - offset < size) {
+    _WAIT_FOR_ROOM(capacity - offset);
+    if (capacity - offset >= sizeof(ChannelRecord))
+      (void)memcpy(header->ring + offset, &(ChannelRecord){.error = CHANNEL_SKIP},
+                   sizeof(ChannelRecord));
+    channel->head += capacity - offset;
+    atomic_store_explicit(&header->head, channel->head, memory_order_release);
+  }
+  _WAIT_FOR_ROOM(size);
+#undef _WAIT_FOR_ROOM
+
+  uint8_t *at = header->ring + (channel->head & (capacity - 1));
+  const ChannelRecord record = {.error = error, .tag = tag, .count = count};
+  (void)memcpy(at, &record, sizeof record);
+  (void)memcpy(at + sizeof record, values, sizeof(Value) * count);
+
+  channel->head += size;
+  atomic_store_explicit(&header->head, channel->head, memory_order_release);
+  return true;
+}
+
+bool channel_peek(Channel *channel, const ChannelRecord **record,
+                  const Value **values)
+{
+  ChannelHeader *header = channel->header;
+  const uint64_t capacity = header->capacity;
+  for (;;) {
+    if (channel->tail == channel->head) {
+      channel->head = atomic_load_explicit(&header->head, memory_order_acquire);
+      if (channel->tail == channel->head) return false;
+    }
+    const uint64_t offset = channel->tail & (capacity - 1);
+    const ChannelRecord *next = (const ChannelRecord *)(header->ring + offset);
+    if (capacity - offset < sizeof(ChannelRecord) || next->error == CHANNEL_SKIP) {
+      channel->tail += capacity - offset;
+      atomic_store_explicit(&header->tail, channel->tail, memory_order_release);
+      continue;
+    }
+    *record = next;
+    *values = (const Value *)(next + 1);
+    channel->pending = sizeof(ChannelRecord) + sizeof(Value) * next->count;
+    return true;
+  }
+}
+
+void channel_wait(Channel *channel, const ChannelRecord **record,
+                  const Value **values)
+{
+  for (unsigned spins = 0; !channel_peek(channel, record, values);) _backoff(&spins);
+}
+
+void channel_release(Channel *channel)
+{
+  channel->tail += channel->pending;
+  channel->pending = 0;
+  atomic_store_explicit(&channel->header->tail, channel->tail, memory_order_release);
+}
@@ -0,0 +1,139 @@
+#ifndef _CHANNEL_H
+#define _CHANNEL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// A result channel is a ring of records in shared memory, written by one
+// producer and read by one consumer at a time:
+//
+//   ChannelHeader
+//   ring[capacity]   ChannelRecord, Value[count], ChannelRecord, ...
+//
+// `head` and `tail` count bytes ever written and consumed; each side
+// only stores its own and reads the other's. A record never wraps: when
+// it does not fit before the end of the ring, the producer skips to the
+// start, marking the gap with a CHANNEL_SKIP record if one fits there.
+// Values are handed to the consumer where they lie in the ring, so
+// reading a result takes no copies, parsing or syscalls.
+//
+// A channel lives in a POSIX shared memory object, or in an anonymous
+// memfd whose descriptor is passed on to the producer.
+#define CHANNEL_MAGIC 0x52564d53 // "SVMR"
+#define CHANNEL_SKIP UINT32_MAX
+#define CHANNEL_MIN_CAPACITY 4096
+
+typedef struct {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t capacity; // bytes in `ring`, a power of two
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Alignas(64) uint8_t ring[];
+} ChannelHeader;
+
+typedef struct {
+  uint32_t error; // `vm_err_t` of the run, or CHANNEL_SKIP
+  uint32_t reserved;
+  uint64_t tag;   // chosen by the producer, e.g. which job this was
+  uint64_t count; // `Value`s that follow
+} ChannelRecord;
+
+typedef struct {
+  ChannelHeader *header;
+  size_t size;
+  int fd;
+  uint64_t head; // own index on one side, cached copy of the other's on
+  uint64_t tail; // the other; the shared ones are read only when needed
+  uint64_t pending; // bytes of the record last handed out by `channel_peek`
+} Channel;
+
+// `name` is a POSIX shared memory name ("/results"), removed again with
+// `shm_unlink`, or NULL for an anonymous memfd whose descriptor is left in
+// `out->fd` and is inherited by children. `channel_open` takes such a
+// name or a descriptor number.
+bool channel_create(const char *name, size_t capacity, Channel *out);
+bool channel_open(const char *name, Channel *out);
+void channel_close(Channel *channel);
+
+// Blocks while the ring is full. Fails if the record can never fit.
+bool channel_push(Channel *channel, uint64_t tag, vm_err_t error,
+                  const Value *values, size_t count);
+
+// Hands out the oldest record, which stays valid until `channel_release`.
+// `channel_peek` returns false if there is none, `channel_wait` waits.
+bool channel_peek(Channel *channel, const ChannelRecord **record,
+                  const Value **values);
+void channel_wait(Channel *channel, const ChannelRecord **record,
+                  const Value **values);
+void channel_release(Channel *channel);
+
+#endif // _CHANNEL_H
+
+#ifdef _TEST_IMPL
+#include <pthread.h>
+
+#include "test.h"
+
+test(channel_round_trip) {
+  Channel producer, consumer;
+  t_assert(channel_create(NULL, 0, &producer));
+  consumer = producer;
+  t_asserteq(producer.header->capacity, CHANNEL_MIN_CAPACITY);
+
+  Value values[100];
+  for (size_t i = 0; i < 100; i++) values[i] = (Value)i - 50;
+  t_assert(!channel_push(&producer, 0, VM_ERR_NONE, values, CHANNEL_MIN_CAPACITY));
+
+  // Sizes that do not divide the ring, so records hit its end in every
+  // possible way.
+  for (size_t round = 0; round < 1000; round++) {
+    const size_t count = round % 100;
+    t_assert(channel_push(&producer, round, round % 3, values, count));
+    const ChannelRecord *record;
+    const Value *got;
+    t_assert(channel_peek(&consumer, &record, &got));
+    t_asserteq(record->tag, round);
+    t_asserteq(record->error, round % 3);
+    t_asserteq(record->count, count);
+    for (size_t i = 0; i < count; i++) t_asserteq(got[i], values[i]);
+    channel_release(&consumer);
+    t_assert(!channel_peek(&consumer, &record, &got));
+  }
+  channel_close(&producer);
+}
+
+static void *_channel_test_producer(void *arg)
+{
+  Channel *channel = arg;
+  Value values[64];
+  for (uint64_t tag = 0; tag < 20000; tag++) {
+    for (size_t i = 0; i < tag % 64; i++) values[i] = tag * 64 + i;
+    if (!channel_push(channel, tag, VM_ERR_NONE, values, tag % 64)) return NULL;
+  }
+  return NULL;
+}
+
+test(channel_across_threads) {
+  Channel producer, consumer;
+  t_assert(channel_create(NULL, 0, &producer));
+  consumer = producer;
+  pthread_t thread;
+  t_asserteq(pthread_create(&thread, NULL, _channel_test_producer, &producer), 0);
+  for (uint64_t tag = 0; tag < 20000; tag++) {
+    const ChannelRecord *record;
+    const Value *values;
+    channel_wait(&consumer, &record, &values);
+    t_asserteq(record->tag, tag);
+    t_asserteq(record->count, tag % 64);
+    for (size_t i = 0; i < tag % 64; i++) t_asserteq(values[i], (Value)(tag * 64 + i));
+    channel_release(&consumer);
+  }
+  t_asserteq(pthread_join(thread, NULL), 0);
+  channel_close(&producer);
+}
+#endif
@@ -0,0 +1,119 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+
+#define _INDEX_IO_ERROR(msg) \
+  do {                       \
+    errmsg = (msg);          \
+    goto IO_ERROR;           \
+  } while (0)
+
+static inline uint64_t _load64(const char *bytes)
+{
+  uint64_t word;
+  (void)memcpy(&word, bytes, sizeof word);
+  return word;
+}
+
+static inline uint64_t _mix(uint64_t hash, uint64_t word)
+{
+  hash = (hash ^ word) * 0xbf58476d1ce4e5b9;
+  return hash ^ (hash >> 31);
+}
+
+// A line ends on a boundary when the 8 bytes up to and including its
+// newline hash to a top byte of zero, so chunks run on for 256 lines past
+// CHUNK_MIN on average.
+static inline bool _is_boundary(const char *newline)
+{
+  return (_load64(newline - 7) * 0x9e3779b97f4a7c15) >> 56 == 0;
+}
+
+size_t chunk_split(const char *source, size_t size, size_t offset)
+{
+  if (size - offset <= CHUNK_MIN) return size;
+  const size_t limit = size - offset > CHUNK_MAX ? offset + CHUNK_MAX : size;
+
+  // Lines that end before CHUNK_MIN are never looked at.
+  const char *cursor = source + offset + CHUNK_MIN - 1;
+  const char *newline;
+  while ((newline = memchr(cursor, '\n', source + limit - cursor)) != NULL) {
+    if (_is_boundary(newline)) return newline - source + 1;
+    cursor = newline + 1;
+  }
+  if (limit == size) return size;
+  newline = memchr(source + limit, '\n', size - limit);
+  return newline ? (size_t)(newline - source + 1) : size;
+}
+
+// Four independent lanes keep the multiplies from waiting on each other;
+// the source is hashed on every build, so this is the incremental path's
+// main cost.
+uint64_t chunk_hash(const char *bytes, size_t length)
+{
+  uint64_t lanes[4] = {
+    0x9e3779b97f4a7c15 ^ length, 0x94d049bb133111eb, 0xd6e8feb86659fd93, 0xa0761d6478bd642f,
+  };
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32)
+    for (size_t k = 0; k < 4; k++) lanes[k] = _mix(lanes[k], _load64(bytes + i + 8 * k));
+
+  uint64_t hash = lanes[0];
+  for (size_t k = 1; k < 4; k++) hash = _mix(hash, lanes[k]);
+  for (; i + 8 <= length; i += 8) hash = _mix(hash, _load64(bytes + i));
+  uint64_t tail = 0;
+  (void)memcpy(&tail, bytes + i, length - i);
+  return _mix(_mix(hash, tail), length);
+}
+
+bool load_index_from_disk(const char *path, IndexHeader *header,
+                          ChunkEntry **entries)
+{
+  *entries = NULL;
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return false;
+  if (fread(header, sizeof *header, 1, file) != 1 ||
+      header->magic != INDEX_MAGIC ||
+      header->count > SIZE_MAX / sizeof(ChunkEntry))
+    goto MALFORMED;
+
+  *entries = malloc(sizeof(ChunkEntry) * (header->count + 1));
+  if (*entries == NULL) exit(1);
+  if (fread(*entries, sizeof(ChunkEntry), header->count, file) != header->count)
+    goto MALFORMED;
+  (void)fclose(file);
+  return true;
+
+MALFORMED:
+  free(*entries);
+  *entries = NULL;
+  (void)fclose(file);
+  return false;
+}
+
+void save_index_to_disk(const char *path, const IndexHeader *header,
+                        const ChunkEntry *entries)
+{
+  const char *errmsg = NULL;
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) _INDEX_IO_ERROR("could not open file");
+  if (fwrite(header, sizeof *header, 1, file) != 1)
+    _INDEX_IO_ERROR("while writing header");
+  if (fwrite(entries, sizeof(ChunkEntry), header->count, file) != header->count)
+    _INDEX_IO_ERROR("while writing chunks");
+  if (fclose(file) != 0) _INDEX_IO_ERROR("while closing file");
+  return;
+
+IO_ERROR:
+  fprintf(stderr, "Error: (operation on %s) %s: %s", path, errmsg, strerror(errno));
+  exit(1);
+}
+
+#undef _INDEX_IO_ERROR
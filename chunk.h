@@ -0,0 +1,138 @@
+#ifndef _CHUNK_H
+#define _CHUNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Incremental assembly (`assembler -i`) cuts the source into chunks of
+// whole lines and keeps an index of them next to the output:
+//
+//   IndexHeader
+//   ChunkEntry[count]   in source order
+//
+// Chunk boundaries depend only on the bytes around them, not on their
+// position, so an edit moves at most the boundaries next to it and every
+// other chunk hashes the same as in the previous build. Chunks are
+// matched by hash rather than position, so their code can be copied from
+// the old output wherever it moved to.
+#define INDEX_MAGIC 0x58564d53 // "SMVX"
+#define CHUNK_MIN (32u << 10)
+#define CHUNK_MAX (1u << 20)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t output_size;     // the output as this index last saw it; any
+  uint64_t output_mtime_ns; // other build invalidates the index
+} IndexHeader;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t source_offset;
+  uint64_t source_length;
+  uint64_t first_line;
+  uint64_t lines;
+  uint64_t code_offset; // in bytes from the start of the output
+  uint64_t instc;
+  uint64_t data_offset; // in bytes from the start of the output
+  uint64_t datac;
+  int64_t memory_size;  // last `.memory` in the chunk, or -1
+} ChunkEntry;
+
+// Returns the end of the chunk that starts at `offset`: just past the
+// first newline at least CHUNK_MIN bytes in whose line ends in a hash
+// boundary, falling back to the first newline past CHUNK_MAX.
+size_t chunk_split(const char *source, size_t size, size_t offset);
+uint64_t chunk_hash(const char *bytes, size_t length);
+
+// Fails quietly when there is no usable index; the caller rebuilds.
+bool load_index_from_disk(const char *path, IndexHeader *header,
+                          ChunkEntry **entries);
+void save_index_to_disk(const char *path, const IndexHeader *header,
+                        const ChunkEntry *entries);
+
+#endif // _CHUNK_H
+
+#ifdef _TEST_IMPL
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+static char *_chunk_test_source(size_t lines, size_t *size)
+{
+  char *source = malloc(lines * 24);
+  if (source == NULL) exit(1);
+  size_t n = 0;
+  for (size_t i = 0; i < lines; i++)
+    n += sprintf(source + n, "push %zu\n", i * 7919 % 100003);
+  *size = n;
+  return source;
+}
+
+test(chunk_split_on_lines) {
+  size_t size;
+  char *source = _chunk_test_source(100000, &size);
+  size_t chunks = 0;
+  for (size_t offset = 0, end; offset < size; offset = end, chunks++) {
+    end = chunk_split(source, size, offset);
+    t_assert(end > offset && end <= size);
+    t_assert(end == size || end - offset >= CHUNK_MIN);
+    t_assert(end - offset <= CHUNK_MAX + 32);
+    t_asserteq(source[end - 1], '\n');
+  }
+  t_assert(chunks > 1);
+  free(source);
+}
+
+static size_t _chunk_test_boundaries(const char *source, size_t size, size_t *out)
+{
+  size_t n = 0;
+  for (size_t offset = 0; offset < size; offset = out[n++])
+    out[n] = chunk_split(source, size, offset);
+  return n;
+}
+
+test(chunk_split_resynchronises) {
+  size_t size;
+  char *source = _chunk_test_source(100000, &size);
+  const char *line = "add\n";
+  const size_t length = strlen(line), at = 11000;
+  char *edited = malloc(size + length);
+  if (edited == NULL) exit(1);
+  (void)memcpy(edited, source, at);
+  (void)memcpy(edited + at, line, length);
+  (void)memcpy(edited + at + length, source + at, size - at);
+
+  size_t before[256], after[256];
+  const size_t nbefore = _chunk_test_boundaries(source, size, before);
+  const size_t nafter = _chunk_test_boundaries(edited, size + length, after);
+  // Every boundary past the one closing the edited chunk survives, moved
+  // by the length of the insertion.
+  size_t moved = 0;
+  for (size_t i = 0, j = 0; i < nbefore && j < nafter;) {
+    if (before[i] + length == after[j]) moved++, i++, j++;
+    else if (before[i] + length < after[j]) i++;
+    else j++;
+  }
+  t_assert(nbefore > 2);
+  t_assert(moved + 1 >= nbefore);
+  free(source);
+  free(edited);
+}
+
+test(chunk_hash_sees_every_byte) {
+  char bytes[67];
+  for (size_t i = 0; i < sizeof bytes; i++) bytes[i] = 'a' + i % 26;
+  const uint64_t hash = chunk_hash(bytes, sizeof bytes);
+  for (size_t i = 0; i < sizeof bytes; i++) {
+    bytes[i] ^= 1;
+    t_assert(chunk_hash(bytes, sizeof bytes) != hash);
+    bytes[i] ^= 1;
+  }
+  t_assert(chunk_hash(bytes, sizeof bytes - 1) != hash);
+}
+#endif
@@ -0,0 +1,478 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+#include "daemon.h"
+#include "disk.h"
+#include "pool.h"
+#include "vm.h"
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+// Request handling of `stackvmd`: the program cache and running requests
+// taken from a connection's input, with no sockets of its own.
+
+#define CACHE_SLOTS 8192 // a power of two, at most half of them used
+
+typedef struct {
+  Prog prog;
+  uint64_t hash;
+  bool from_bundle;
+  size_t bytes;       // of code and linear memory
+  atomic_size_t refs; // one per slot and per request running it
+} Cached;
+
+typedef struct {
+  daemon_req_t kind;
+  uint64_t key;
+  char *name; // path, bundle name or image bytes, NULL for content hashes
+  size_t length;
+  atomic_bool used; // looked up since the clock hand last passed it
+  Cached *cached;
+} Slot;
+
+// Open-addressed table from (kind, key) to a loaded program, which is also
+// reachable by its content hash. Past `CACHE_SLOTS / 2` entries or
+// `cache_limit` bytes, entries that were not looked up since the clock
+// hand last came by are evicted; a program stays loaded until the last
+// request running it is done.
+typedef struct {
+  pthread_rwlock_t lock;
+  Slot slots[CACHE_SLOTS];
+  size_t count;
+  size_t bytes; // of the programs and names of all entries
+  size_t hand;
+} Cache;
+static Cache cache = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+static Bundle bundle;
+static bool have_bundle = false;
+static DaemonConfig config;
+
+void daemon_init(const DaemonConfig *with)
+{
+  config = *with;
+  if (config.bundle_path != NULL && !have_bundle) {
+    bundle_open(config.bundle_path, &bundle);
+    have_bundle = true;
+  }
+}
+
+static uint64_t _fnv(uint64_t hash, const void *bytes_, size_t length)
+{
+  const uint8_t *bytes = bytes_;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// Identifies a program by what it runs rather than where it came from, so
+// the same program has the same hash whether it was sent by path, inline
+// or from the bundle.
+static uint64_t prog_hash(const Prog *prog)
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  hash = _fnv(hash, prog->code, sizeof(Inst) * prog->count);
+  hash = _fnv(hash, prog->memory, sizeof(Value) * prog->datac);
+  return _fnv(hash, &prog->memory_size, sizeof prog->memory_size);
+}
+
+static bool _same_prog(const Prog *a, const Prog *b)
+{
+  return a->count == b->count &&
+         a->memory_size == b->memory_size && a->datac == b->datac &&
+         memcmp(a->code, b->code, sizeof(Inst) * a->count) == 0 &&
+         (a->datac == 0 || memcmp(a->memory, b->memory, sizeof(Value) * a->datac) == 0);
+}
+
+static bool _slot_matches(const Slot *slot, daemon_req_t kind, uint64_t key,
+                          const char *name, size_t length)
+{
+  return slot->cached != NULL && slot->kind == kind && slot->key == key &&
+         (name == NULL ||
+          (slot->length == length && memcmp(slot->name, name, length) == 0));
+}
+
+static Slot *_cache_probe(daemon_req_t kind, uint64_t key,
+                          const char *name, size_t length)
+{
+  for (size_t i = key & (CACHE_SLOTS - 1);; i = (i + 1) & (CACHE_SLOTS - 1)) {
+    Slot *slot = &cache.slots[i];
+    if (slot->cached == NULL || _slot_matches(slot, kind, key, name, length))
+      return slot;
+  }
+}
+
+static void cache_release(Cached *cached)
+{
+  if (atomic_fetch_sub(&cached->refs, 1) != 1) return;
+  if (cached->from_bundle) bundle_release(&cached->prog);
+  else free_image(&cached->prog);
+  free(cached);
+}
+
+// The caller gets a reference to the program, to be given back with
+// `cache_release`.
+static Cached *cache_get(daemon_req_t kind, uint64_t key,
+                         const char *name, size_t length)
+{
+  pthread_rwlock_rdlock(&cache.lock);
+  Slot *slot = _cache_probe(kind, key, name, length);
+  Cached *cached = slot->cached;
+  if (cached != NULL) {
+    atomic_store_explicit(&slot->used, true, memory_order_relaxed);
+    atomic_fetch_add(&cached->refs, 1);
+  }
+  pthread_rwlock_unlock(&cache.lock);
+  return cached;
+}
+
+// Must hold the write lock.
+static void _cache_insert(daemon_req_t kind, uint64_t key,
+                          const char *name, size_t length, Cached *cached)
+{
+  Slot *slot = _cache_probe(kind, key, name, length);
+  if (slot->cached != NULL) return;
+  char *copy = NULL;
+  if (name != NULL) {
+    copy = malloc(length);
+    if (copy == NULL) exit(1);
+    (void)memcpy(copy, name, length);
+  }
+  *slot = (Slot){.kind = kind, .key = key, .name = copy, .length = length,
+                 .used = true, .cached = cached};
+  atomic_fetch_add(&cached->refs, 1);
+  cache.count++;
+  cache.bytes += cached->bytes + length;
+}
+
+// Empties slot `i` and moves later entries of its probe run back into the
+// hole, so no lookup stops short of them. Must hold the write lock.
+static void _cache_remove(size_t i)
+{
+  const size_t mask = CACHE_SLOTS - 1;
+  Slot *slot = &cache.slots[i];
+  cache.count--;
+  cache.bytes -= slot->cached->bytes + slot->length;
+  free(slot->name);
+  cache_release(slot->cached);
+  for (size_t j = (i + 1) & mask; cache.slots[j].cached != NULL; j = (j + 1) & mask) {
+    const size_t home = cache.slots[j].key & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      cache.slots[i] = cache.slots[j];
+      i = j;
+    }
+  }
+  cache.slots[i] = (Slot){0};
+}
+
+// Must hold the write lock.
+static void _cache_evict(void)
+{
+  while (cache.count != 0 &&
+         (cache.count > CACHE_SLOTS / 2 || cache.bytes > config.cache_limit)) {
+    Slot *slot = &cache.slots[cache.hand];
+    if (slot->cached == NULL ||
+        atomic_exchange_explicit(&slot->used, false, memory_order_relaxed)) {
+      cache.hand = (cache.hand + 1) & (CACHE_SLOTS - 1);
+      continue;
+    }
+    // Another entry may have moved into its place, so the hand stays.
+    _cache_remove(cache.hand);
+  }
+}
+
+// Publishes a freshly loaded program under `kind`/`key` and, unless a
+// different program already has its content hash, under that hash. If
+// another thread got there first, or the very same program is known by
+// its hash, that copy wins. Either way the caller gets a reference.
+static Cached *cache_put(daemon_req_t kind, uint64_t key,
+                         const char *name, size_t length, Prog *prog)
+{
+  Cached *cached = malloc(sizeof(Cached));
+  if (cached == NULL) exit(1);
+  *cached = (Cached){
+    .prog = *prog,
+    .hash = prog_hash(prog),
+    .from_bundle = kind == DAEMON_REQ_NAME,
+    .bytes = sizeof(Inst) * prog->count + sizeof(Value) * prog->memory_size,
+    .refs = 1,
+  };
+
+  pthread_rwlock_wrlock(&cache.lock);
+  Cached *existing = _cache_probe(kind, key, name, length)->cached;
+  if (existing == NULL) {
+    Cached *same_hash = _cache_probe(DAEMON_REQ_HASH, cached->hash, NULL, 0)->cached;
+    if (same_hash == NULL) _cache_insert(DAEMON_REQ_HASH, cached->hash, NULL, 0, cached);
+    else if (_same_prog(&same_hash->prog, prog)) existing = same_hash;
+    _cache_insert(kind, key, name, length, existing ? existing : cached);
+  }
+  if (existing != NULL) atomic_fetch_add(&existing->refs, 1);
+  _cache_evict();
+  pthread_rwlock_unlock(&cache.lock);
+
+  if (existing == NULL) return cached;
+  cache_release(cached);
+  return existing;
+}
+
+static uint8_t *_read_fd(int fd, size_t size)
+{
+  uint8_t *bytes = malloc(size + 1);
+  if (bytes == NULL) exit(1);
+  for (size_t done = 0; done < size;) {
+    ssize_t n = read(fd, bytes + done, size - done);
+    if (n <= 0) {
+      free(bytes);
+      return NULL;
+    }
+    done += n;
+  }
+  return bytes;
+}
+
+// A path's program is cached under the path followed by the identity and
+// version of the file it names, so a file that was edited or replaced
+// since is read again rather than served stale.
+static char *_path_key(const DaemonRequest *req, const char *name, int *fd,
+                       size_t *length, struct stat *st)
+{
+  char *path = malloc(req->length + 1);
+  if (path == NULL) exit(1);
+  (void)memcpy(path, name, req->length);
+  path[req->length] = '\0';
+  *fd = open(path, O_RDONLY);
+  if (*fd < 0 || fstat(*fd, st) != 0 || !S_ISREG(st->st_mode)) {
+    if (*fd >= 0) (void)close(*fd);
+    free(path);
+    return NULL;
+  }
+  const uint64_t version[] = {
+    st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+  };
+  *length = req->length + 1 + sizeof version;
+  char *key = realloc(path, *length);
+  if (key == NULL) exit(1);
+  (void)memcpy(key + req->length + 1, version, sizeof version);
+  return key;
+}
+
+// Programs arrive from clients, so one that cannot even start, or that
+// would have every request allocate and clear more memory than allowed, is
+// turned away before it is cached.
+static bool _loaded(bool ok, Prog *prog)
+{
+  if (ok && prog->count != 0 && prog->memory_size <= config.max_memory)
+    return true;
+  if (ok) free_image(prog);
+  return false;
+}
+
+static uint32_t resolve(const DaemonRequest *req, const uint8_t *payload,
+                        Cached **out)
+{
+  const char *name = (const char *)payload;
+  const uint64_t key = _fnv(0xcbf29ce484222325, payload, req->length);
+  Prog prog;
+
+  switch ((daemon_req_t)req->kind) {
+  case DAEMON_REQ_HASH: {
+    uint64_t hash;
+    if (req->length != sizeof hash) return DAEMON_ERR_BAD_REQUEST;
+    (void)memcpy(&hash, payload, sizeof hash);
+    *out = cache_get(DAEMON_REQ_HASH, hash, NULL, 0);
+    return *out ? VM_ERR_NONE : DAEMON_ERR_NO_PROGRAM;
+  }
+
+  case DAEMON_REQ_CODE: {
+    if ((*out = cache_get(DAEMON_REQ_CODE, key, name, req->length)) != NULL)
+      return VM_ERR_NONE;
+    if (!_loaded(load_image_from_bytes(payload, req->length, &prog), &prog))
+      return DAEMON_ERR_BAD_PROGRAM;
+    *out = cache_put(DAEMON_REQ_CODE, key, name, req->length, &prog);
+    return VM_ERR_NONE;
+  }
+
+  case DAEMON_REQ_PATH: {
+    int fd;
+    size_t length;
+    struct stat st;
+    char *path_key = _path_key(req, name, &fd, &length, &st);
+    if (path_key == NULL) return DAEMON_ERR_NO_PROGRAM;
+    const uint64_t versioned = _fnv(0xcbf29ce484222325, path_key, length);
+    uint32_t err = VM_ERR_NONE;
+    if ((*out = cache_get(DAEMON_REQ_PATH, versioned, path_key, length)) != NULL)
+      goto PATH_DONE;
+    err = DAEMON_ERR_BAD_PROGRAM;
+    if ((size_t)st.st_size > DAEMON_MAX_PAYLOAD) goto PATH_DONE;
+    uint8_t *bytes = _read_fd(fd, st.st_size);
+    if (bytes == NULL) goto PATH_DONE;
+    const bool ok = _loaded(load_image_from_bytes(bytes, st.st_size, &prog), &prog);
+    free(bytes);
+    if (!ok) goto PATH_DONE;
+    *out = cache_put(DAEMON_REQ_PATH, versioned, path_key, length, &prog);
+    err = VM_ERR_NONE;
+
+  PATH_DONE:
+    (void)close(fd);
+    free(path_key);
+    return err;
+  }
+
+  case DAEMON_REQ_NAME: {
+    if ((*out = cache_get(DAEMON_REQ_NAME, key, name, req->length)) != NULL)
+      return VM_ERR_NONE;
+    if (!have_bundle) return DAEMON_ERR_NO_PROGRAM;
+    char *copy = malloc(req->length + 1);
+    if (copy == NULL) exit(1);
+    (void)memcpy(copy, name, req->length);
+    copy[req->length] = '\0';
+    const BundleEntry *entry = bundle_find(&bundle, copy);
+    free(copy);
+    if (entry == NULL) return DAEMON_ERR_NO_PROGRAM;
+    bundle_load(&bundle, entry, &prog);
+    if (prog.memory_size > config.max_memory) {
+      bundle_release(&prog);
+      return DAEMON_ERR_BAD_PROGRAM;
+    }
+    *out = cache_put(DAEMON_REQ_NAME, key, name, req->length, &prog);
+    return VM_ERR_NONE;
+  }
+
+  default: return DAEMON_ERR_BAD_REQUEST;
+  }
+}
+
+static void _reserve(uint8_t **buffer, size_t *capacity, size_t needed)
+{
+  if (needed <= *capacity) return;
+  while (*capacity < needed) *capacity *= 2;
+  *buffer = realloc(*buffer, *capacity);
+  if (*buffer == NULL) exit(1);
+}
+
+DaemonWorker *daemon_worker_new(void)
+{
+  DaemonWorker *w = calloc(1, sizeof(DaemonWorker));
+  if (w == NULL) exit(1);
+  return w;
+}
+
+void daemon_conn_init(DaemonConn *c)
+{
+  *c = (DaemonConn){.in_cap = 4096, .out_cap = 4096, .needed = sizeof(DaemonRequest)};
+  c->in = malloc(c->in_cap);
+  c->out = malloc(c->out_cap);
+  if (c->in == NULL || c->out == NULL) exit(1);
+}
+
+void daemon_conn_free(DaemonConn *c)
+{
+  free(c->in);
+  free(c->out);
+  *c = (DaemonConn){0};
+}
+
+void daemon_conn_reserve(DaemonConn *c)
+{
+  _reserve(&c->in, &c->in_cap, c->needed > c->in_len ? c->needed : c->in_len + 1);
+}
+
+static void respond(DaemonConn *c, uint32_t error, const Value *values,
+                    size_t count, uint64_t hash)
+{
+  const DaemonResponse resp = {.error = error, .count = count, .hash = hash};
+  const size_t bytes = sizeof resp + sizeof(Value) * count;
+  _reserve(&c->out, &c->out_cap, c->out_len + bytes);
+  (void)memcpy(c->out + c->out_len, &resp, sizeof resp);
+  (void)memcpy(c->out + c->out_len + sizeof resp, values, sizeof(Value) * count);
+  c->out_len += bytes;
+}
+
+// The worker's VM is reused for every request; only its registers are
+// reset, and programs with linear memory get a fresh copy of their
+// initial memory in the worker's own buffer. Each request may run at
+// most `max_steps` instructions, its spawned children included.
+static void handle(DaemonWorker *w, DaemonConn *c, const DaemonRequest *req,
+                   const uint8_t *payload, const uint8_t *args)
+{
+  Cached *cached = NULL;
+  uint32_t error = resolve(req, payload, &cached);
+  if (error != VM_ERR_NONE) {
+    respond(c, error, NULL, 0, 0);
+    return;
+  }
+
+  const Prog *prog = &cached->prog;
+  VM *vm = &w->vm;
+  vm->code = prog->code;
+  vm->count = prog->count;
+  vm->ip = 0;
+  vm->sp = req->argc;
+  (void)memcpy(vm->stack, args, sizeof(Value) * req->argc);
+  vm->rsp = 0;
+  vm->halted = false;
+  vm->pool = config.pool;
+  atomic_store(&w->budget, config.max_steps);
+  vm->budget = &w->budget;
+  vm->fuel = 0;
+  vm->memory = NULL;
+  vm->memory_size = prog->memory_size;
+  if (prog->memory_size != 0) {
+    if (w->memory_capacity < prog->memory_size) {
+      free(w->memory);
+      w->memory = malloc(sizeof(Value) * prog->memory_size);
+      if (w->memory == NULL) exit(1);
+      w->memory_capacity = prog->memory_size;
+    }
+    (void)memcpy(w->memory, prog->memory, sizeof(Value) * prog->datac);
+    (void)memset(w->memory + prog->datac, 0,
+                 sizeof(Value) * (prog->memory_size - prog->datac));
+    vm->memory = w->memory;
+  }
+
+  error = vm_run(vm);
+  pool_reap(config.pool, vm);
+  respond(c, error, vm->stack, vm->sp, cached->hash);
+  cache_release(cached);
+}
+
+// Handles every complete request that has arrived, queueing the responses
+// to go out together, so pipelined requests share syscalls.
+void daemon_handle_all(DaemonWorker *w, DaemonConn *c)
+{
+  size_t pos = 0;
+  c->needed = sizeof(DaemonRequest);
+  while (c->in_len - pos >= sizeof(DaemonRequest)) {
+    DaemonRequest req;
+    (void)memcpy(&req, c->in + pos, sizeof req);
+    if (req.length > DAEMON_MAX_PAYLOAD || req.argc > VM_STACK_CAPACITY) {
+      respond(c, DAEMON_ERR_BAD_REQUEST, NULL, 0, 0);
+      c->closing = true;
+      pos = c->in_len;
+      break;
+    }
+    const size_t total = sizeof req + req.length + sizeof(Value) * req.argc;
+    if (c->in_len - pos < total) {
+      c->needed = total;
+      break;
+    }
+    const uint8_t *payload = c->in + pos + sizeof req;
+    handle(w, c, &req, payload, payload + req.length);
+    pos += total;
+  }
+  (void)memmove(c->in, c->in + pos, c->in_len - pos);
+  c->in_len -= pos;
+}
@@ -0,0 +1,357 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// Wire protocol of `stackvmd`, in host byte order over a Unix domain
+// socket. A client may write any number of requests before reading;
+// responses come back in request order.
+//
+//   request:  DaemonRequest, payload[length], Value[argc]
+//   response: DaemonResponse, Value[count]
+//
+// The payload names the program: a file path, the 8-byte content hash
+// reported by an earlier response, the bytes of a `.ins` file, or a
+// program name in the bundle the daemon was started with. The values
+// become the initial stack, bottom first.
+
+typedef enum {
+  DAEMON_REQ_PATH = 1,
+  DAEMON_REQ_HASH,
+  DAEMON_REQ_CODE,
+  DAEMON_REQ_NAME,
+} daemon_req_t;
+
+// Errors that are not from the VM itself, numbered clear of `vm_err_t`.
+typedef enum {
+  DAEMON_ERR_NO_PROGRAM = 0x100,
+  DAEMON_ERR_BAD_PROGRAM,
+  DAEMON_ERR_BAD_REQUEST,
+} daemon_err_t;
+
+#define DAEMON_MAX_PAYLOAD (64u << 20)
+
+typedef struct {
+  uint32_t kind;
+  uint32_t length;
+  uint32_t argc;
+  uint32_t reserved;
+} DaemonRequest;
+
+typedef struct {
+  uint32_t error; // `vm_err_t` or `daemon_err_t`
+  uint32_t count;
+  uint64_t hash;  // content hash of the program that ran, 0 if none
+} DaemonResponse;
+
+// The server side, in daemon.c; `stackvmd` puts it on a socket.
+
+typedef struct {
+  const char *bundle_path; // NULL for none
+  struct Pool *pool;       // runs spawned children, inline if NULL
+  uint64_t max_steps;      // per request, spawned children included
+  size_t cache_limit;      // bytes of programs kept loaded
+  size_t max_memory;       // `Value`s of linear memory a program may have
+} DaemonConfig;
+
+// One per thread that runs requests. Its VM and linear memory are reused
+// for every request.
+typedef struct {
+  VM vm;
+  _Atomic uint64_t budget; // shared by the request's VM and its children
+  Value *memory;
+  size_t memory_capacity;
+} DaemonWorker;
+
+// What one client has sent and is yet to be sent.
+typedef struct {
+  uint8_t *in;
+  size_t in_len;
+  size_t in_cap;
+  size_t needed; // bytes in `in` before another request is complete
+  uint8_t *out;
+  size_t out_len;
+  size_t out_cap;
+  bool closing;  // after a malformed request, once `out` is written
+} DaemonConn;
+
+void daemon_init(const DaemonConfig *config);
+DaemonWorker *daemon_worker_new(void);
+void daemon_conn_init(DaemonConn *c);
+void daemon_conn_free(DaemonConn *c);
+// Makes room after `in_len` for at least the rest of the next request.
+void daemon_conn_reserve(DaemonConn *c);
+// Answers every complete request in `in`, dropping it from there and
+// appending the responses to `out`.
+void daemon_handle_all(DaemonWorker *w, DaemonConn *c);
+
+#endif // _DAEMON_H
+
+#ifdef _TEST_IMPL
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "test.h"
+
+static void _daemon_send(DaemonConn *c, daemon_req_t kind, const void *payload,
+                         size_t length, const Value *args, size_t argc)
+{
+  const DaemonRequest req = {.kind = kind, .length = length, .argc = argc};
+  const size_t bytes = sizeof req + length + sizeof(Value) * argc;
+  c->needed = c->in_len + bytes;
+  daemon_conn_reserve(c);
+  uint8_t *at = c->in + c->in_len;
+  (void)memcpy(at, &req, sizeof req);
+  if (length != 0) (void)memcpy(at + sizeof req, payload, length);
+  if (argc != 0) (void)memcpy(at + sizeof req + length, args, sizeof(Value) * argc);
+  c->in_len += bytes;
+}
+
+// Takes the next response from `out`, which must hold one.
+static DaemonResponse _daemon_receive(const DaemonConn *c, size_t *pos, const Value **values)
+{
+  DaemonResponse resp;
+  t_assert(c->out_len - *pos >= sizeof resp);
+  (void)memcpy(&resp, c->out + *pos, sizeof resp);
+  t_assert(c->out_len - *pos - sizeof resp >= sizeof(Value) * resp.count);
+  *values = (const Value *)(c->out + *pos + sizeof resp);
+  *pos += sizeof resp + sizeof(Value) * resp.count;
+  return resp;
+}
+
+// Sends one request and returns the error of its response, leaving the
+// values in `out`.
+static uint32_t _daemon_run(DaemonWorker *w, DaemonConn *c, daemon_req_t kind,
+                            const void *payload, size_t length, const Value **values)
+{
+  c->out_len = 0;
+  _daemon_send(c, kind, payload, length, NULL, 0);
+  daemon_handle_all(w, c);
+  size_t pos = 0;
+  const uint32_t error = _daemon_receive(c, &pos, values).error;
+  t_asserteq(pos, c->out_len);
+  return error;
+}
+
+static void _daemon_test_init(uint64_t max_steps, size_t cache_limit)
+{
+  const DaemonConfig config = {.max_steps = max_steps, .cache_limit = cache_limit,
+                               .max_memory = 1024};
+  daemon_init(&config);
+}
+
+test(daemon_pipelined_requests) {
+  _daemon_test_init(1000, 1 << 20);
+  DaemonWorker *w = daemon_worker_new();
+  DaemonConn c;
+  daemon_conn_init(&c);
+
+  Inst add[] = { inst_add, inst_halt };
+  Inst push[] = { inst_push(7), inst_halt };
+  const Value args[] = { 2, 3 };
+  _daemon_send(&c, DAEMON_REQ_CODE, add, sizeof add, args, 2);
+  _daemon_send(&c, DAEMON_REQ_CODE, push, sizeof push, NULL, 0);
+  _daemon_send(&c, DAEMON_REQ_CODE, add, sizeof add, args, 1);
+  // Only the header and part of the payload of a fourth have arrived.
+  _daemon_send(&c, DAEMON_REQ_CODE, push, sizeof push, args, 2);
+  c.in_len -= sizeof(Inst) + 2 * sizeof(Value);
+  daemon_handle_all(w, &c);
+
+  size_t pos = 0;
+  const Value *values;
+  DaemonResponse resp = _daemon_receive(&c, &pos, &values);
+  t_asserteq(resp.error, VM_ERR_NONE);
+  t_asserteq(resp.count, 1);
+  t_asserteq(values[0], 5);
+  const uint64_t add_hash = resp.hash;
+  resp = _daemon_receive(&c, &pos, &values);
+  t_asserteq(resp.error, VM_ERR_NONE);
+  t_asserteq(values[0], 7);
+  t_assert(resp.hash != add_hash);
+  resp = _daemon_receive(&c, &pos, &values);
+  t_asserteq(resp.error, VM_ERR_STACK_UNDERFLOW);
+  t_asserteq(resp.hash, add_hash);
+  t_asserteq(pos, c.out_len);
+
+  // The partial request waits for the rest of it.
+  t_asserteq(c.in_len, sizeof(DaemonRequest) + sizeof(Inst));
+  t_asserteq(c.needed, sizeof(DaemonRequest) + sizeof push + sizeof args);
+  t_assert(!c.closing);
+  c.out_len = 0;
+  c.in_len += sizeof(Inst) + 2 * sizeof(Value);
+  daemon_handle_all(w, &c);
+  pos = 0;
+  resp = _daemon_receive(&c, &pos, &values);
+  t_asserteq(resp.error, VM_ERR_NONE);
+  t_asserteq(resp.count, 3);
+  t_asserteq(values[2], 7);
+  t_asserteq(c.in_len, 0);
+
+  // And by the hash an earlier response reported.
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_HASH, &add_hash, sizeof add_hash, &values),
+             VM_ERR_STACK_UNDERFLOW);
+  daemon_conn_free(&c);
+  free(w);
+}
+
+test(daemon_rejects_malformed_requests) {
+  _daemon_test_init(1000, 1 << 20);
+  DaemonWorker *w = daemon_worker_new();
+  DaemonConn c;
+  daemon_conn_init(&c);
+  const Value *values;
+  Inst push[] = { inst_push(1), inst_halt };
+
+  // Answered, and the connection carries on.
+  t_asserteq(_daemon_run(w, &c, 99, push, sizeof push, &values), DAEMON_ERR_BAD_REQUEST);
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_HASH, push, 3, &values), DAEMON_ERR_BAD_REQUEST);
+  const uint64_t unknown = 12345;
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_HASH, &unknown, sizeof unknown, &values),
+             DAEMON_ERR_NO_PROGRAM);
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_PATH, "/nonexistent", 12, &values),
+             DAEMON_ERR_NO_PROGRAM);
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_NAME, "main", 4, &values), DAEMON_ERR_NO_PROGRAM);
+  t_assert(!c.closing);
+
+  // Headers that cannot be trusted to find the next request end the
+  // connection, whatever follows them.
+  const DaemonRequest bad[] = {
+    {.kind = DAEMON_REQ_CODE, .length = sizeof push, .argc = VM_STACK_CAPACITY + 1},
+    {.kind = DAEMON_REQ_CODE, .length = DAEMON_MAX_PAYLOAD + 1},
+  };
+  for (size_t i = 0; i < sizeof bad / sizeof bad[0]; i++) {
+    c.in_len = c.out_len = 0;
+    c.closing = false;
+    c.needed = sizeof bad[i];
+    daemon_conn_reserve(&c);
+    (void)memcpy(c.in, &bad[i], sizeof bad[i]);
+    c.in_len = sizeof bad[i];
+    _daemon_send(&c, DAEMON_REQ_CODE, push, sizeof push, NULL, 0);
+    daemon_handle_all(w, &c);
+    size_t pos = 0;
+    t_asserteq(_daemon_receive(&c, &pos, &values).error, DAEMON_ERR_BAD_REQUEST);
+    t_asserteq(pos, c.out_len);
+    t_assert(c.closing);
+    t_asserteq(c.in_len, 0);
+  }
+  daemon_conn_free(&c);
+  free(w);
+}
+
+// Programs that used to crash the daemon or hold on to a worker forever.
+test(daemon_untrusted_programs) {
+  _daemon_test_init(100000, 1 << 20);
+  DaemonWorker *w = daemon_worker_new();
+  DaemonConn c;
+  daemon_conn_init(&c);
+  const Value *values;
+
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, "", 0, &values), DAEMON_ERR_BAD_PROGRAM);
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, "12345", 5, &values), DAEMON_ERR_BAD_PROGRAM);
+  Inst far[] = { inst_jmp((Value)1 << 40) };
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, far, sizeof far, &values),
+             VM_ERR_IP_OUT_OF_BOUNDS);
+  Inst unended[] = { inst_push(1) };
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, unended, sizeof unended, &values),
+             VM_ERR_IP_OUT_OF_BOUNDS);
+  Inst spin[] = { inst_jmp(0) };
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, spin, sizeof spin, &values),
+             VM_ERR_BUDGET_EXHAUSTED);
+  // Every request starts with a full budget.
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, spin, sizeof spin, &values),
+             VM_ERR_BUDGET_EXHAUSTED);
+  // Children left spinning are waited for, but share the budget.
+  Inst children[] = {
+    inst_push(0), inst_spawn(4), inst_push(0), inst_spawn(2), inst_halt, inst_jmp(0),
+  };
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, children, sizeof children, &values),
+             VM_ERR_NONE);
+
+  // An image whose header claims more than there is.
+  struct {
+    ProgHeader header;
+    Inst code[1];
+  } image = {
+    .header = {.magic = PROG_MAGIC, .count = 2},
+    .code = { inst_halt },
+  };
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, &image, sizeof image, &values),
+             DAEMON_ERR_BAD_PROGRAM);
+
+  // More linear memory than a worker hands out, however little code.
+  image.header.count = 1;
+  image.header.memory_size = PROG_MAX_MEMORY;
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, &image, sizeof image, &values),
+             DAEMON_ERR_BAD_PROGRAM);
+  image.header.memory_size = 1024;
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, &image, sizeof image, &values),
+             VM_ERR_NONE);
+
+  // A path is read and cached like inline code, until the file changes.
+  char path[] = "/tmp/daemon_test_XXXXXX";
+  int fd = mkstemp(path);
+  t_assert(fd >= 0);
+  t_asserteq(write(fd, far, sizeof far), (ssize_t)sizeof far);
+  (void)close(fd);
+  for (int i = 0; i < 2; i++)
+    t_asserteq(_daemon_run(w, &c, DAEMON_REQ_PATH, path, strlen(path), &values),
+               VM_ERR_IP_OUT_OF_BOUNDS);
+  // Same size, so only the modification time tells the edit apart.
+  Inst edited[] = { inst_halt };
+  fd = open(path, O_WRONLY | O_TRUNC);
+  t_assert(fd >= 0);
+  t_asserteq(write(fd, edited, sizeof edited), (ssize_t)sizeof edited);
+  const struct timespec times[] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = 1}};
+  t_asserteq(futimens(fd, times), 0);
+  (void)close(fd);
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_PATH, path, strlen(path), &values),
+             VM_ERR_NONE);
+  (void)unlink(path);
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_PATH, path, strlen(path), &values),
+             DAEMON_ERR_NO_PROGRAM);
+  daemon_conn_free(&c);
+  free(w);
+}
+
+test(daemon_cache_eviction) {
+  DaemonWorker *w = daemon_worker_new();
+  DaemonConn c;
+  daemon_conn_init(&c);
+  const Value *values;
+
+  // With no room at all, every program is evicted again once it is in,
+  // but still runs.
+  _daemon_test_init(1000, 0);
+  Inst first[] = { inst_push(1), inst_halt };
+  Inst second[] = { inst_push(2), inst_halt };
+  _daemon_send(&c, DAEMON_REQ_CODE, first, sizeof first, NULL, 0);
+  daemon_handle_all(w, &c);
+  size_t pos = 0;
+  const DaemonResponse resp = _daemon_receive(&c, &pos, &values);
+  t_asserteq(values[0], 1);
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_HASH, &resp.hash, sizeof resp.hash, &values),
+             DAEMON_ERR_NO_PROGRAM);
+
+  // Many programs, more than fit in the table, each still the right one.
+  _daemon_test_init(1000, 1 << 20);
+  for (Value i = 0; i < 3 * 8192; i++) {
+    Inst code[] = { inst_push(i % 5000), inst_halt };
+    t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, code, sizeof code, &values), VM_ERR_NONE);
+    t_asserteq(values[0], i % 5000);
+  }
+  t_asserteq(_daemon_run(w, &c, DAEMON_REQ_CODE, second, sizeof second, &values),
+             VM_ERR_NONE);
+  t_asserteq(values[0], 2);
+  daemon_conn_free(&c);
+  free(w);
+}
+#endif
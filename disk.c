@@ -1,9 +1,14 @@
+#define _DEFAULT_SOURCE
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "disk.h"
 #include "vm.h"
@@ -17,8 +22,33 @@ static inline void _bswap_inst_in_place(Inst *instruction)
   instruction->type = __builtin_bswap32(instruction->type);
   instruction->operand = __builtin_bswap64(instruction->operand);
 }
+
+static inline void _bswap_header_in_place(ProgHeader *header)
+{
+  header->magic = __builtin_bswap32(header->magic);
+  header->count = __builtin_bswap64(header->count);
+  header->memory_size = __builtin_bswap64(header->memory_size);
+  header->datac = __builtin_bswap64(header->datac);
+  header->data_offset = __builtin_bswap64(header->data_offset);
+}
+
+static inline void _bswap_values_in_place(Value *values, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    values[i] = __builtin_bswap64(values[i]);
+}
 #endif
 
+static inline size_t _align_up(size_t value, size_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static inline size_t _memory_mapping_size(size_t memory_size)
+{
+  return _align_up(sizeof(Value) * memory_size, sysconf(_SC_PAGESIZE));
+}
+
 Inst *copy_prog(const Inst *instructions, size_t count)
 {
   Inst *buffer = malloc(sizeof(Inst) * count);
@@ -39,6 +69,7 @@ void save_bytes_to_disk(const char *path, const uint8_t *bytes, size_t count)
   if (file == NULL) _DISK_IO_ERROR("could not open file");
   const size_t written = fwrite(bytes, 1, count, file);
   if (written != count) _DISK_IO_ERROR("while writing to file");
+  if (fclose(file) != 0) _DISK_IO_ERROR("while closing file");
   return;
 
 IO_ERROR:
@@ -56,10 +87,12 @@ uint8_t *load_bytes_from_disk(const char* path, size_t *nread)
   int length = ftell(file);
   if (length < 0) _DISK_IO_ERROR("while trying to determine position of FD");
   (void)fseek(file, 0L, SEEK_SET);
-  uint8_t *buffer = malloc(length);
+  // One extra byte so text files can be handed to the lexer as a C string.
+  uint8_t *buffer = malloc(length + 1);
   if (buffer == NULL) exit(1);
   const size_t nread_ = fread(buffer, 1, length, file);
   if (nread_ != (size_t)length) _DISK_IO_ERROR("while trying to read whole file");
+  buffer[length] = '\0';
   *nread = nread_;
   return buffer;
 
@@ -91,4 +124,229 @@ Inst *load_prog_from_disk(const char *path, size_t *const nread)
   return buffer;
 }
 
+void save_image_to_disk(const char *path, const Prog *prog)
+{
+  const char* errmsg = NULL;
+
+  const size_t code_end = sizeof(ProgHeader) + sizeof(Inst) * prog->count;
+  ProgHeader header = {
+    .magic = PROG_MAGIC,
+    .count = prog->count,
+    .memory_size = prog->memory_size,
+    .datac = prog->datac,
+    .data_offset = prog->datac ? _align_up(code_end, PROG_DATA_ALIGN) : code_end,
+  };
+  const size_t data_offset = header.data_offset;
+#if __BYTE_ORDER__ == __BSWAP_ON
+  _bswap_header_in_place(&header);
+  for (size_t i = 0; i < prog->count; i++)
+    _bswap_inst_in_place(prog->code + i);
+  _bswap_values_in_place(prog->memory, prog->datac);
+#endif
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) _DISK_IO_ERROR("could not open file");
+  if (fwrite(&header, sizeof header, 1, file) != 1)
+    _DISK_IO_ERROR("while writing header");
+  if (fwrite(prog->code, sizeof(Inst), prog->count, file) != prog->count)
+    _DISK_IO_ERROR("while writing code");
+  // Seeking past the end leaves a hole that reads back as zeros.
+  if (fseek(file, data_offset, SEEK_SET) != 0)
+    _DISK_IO_ERROR("while seeking to the data segment");
+  if (fwrite(prog->memory, sizeof(Value), prog->datac, file) != prog->datac)
+    _DISK_IO_ERROR("while writing data segment");
+  if (fclose(file) != 0) _DISK_IO_ERROR("while closing file");
+
+#if __BYTE_ORDER__ == __BSWAP_ON
+  for (size_t i = 0; i < prog->count; i++)
+    _bswap_inst_in_place(prog->code + i);
+  _bswap_values_in_place(prog->memory, prog->datac);
+#endif
+  return;
+
+IO_ERROR:
+  fprintf(stderr, "Error: (operation on %s) %s: %s", path, errmsg, strerror(errno));
+  exit(1);
+}
+
+// Reserves zeroed linear memory and maps the data segment copy-on-write
+// over its start, so initialised data is never copied out of the page
+// cache. Falls back to reading it when the offset is not page aligned.
+Value *map_memory(int fd, const ProgHeader *header)
+{
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t length = _memory_mapping_size(header->memory_size);
+  uint8_t *memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) return NULL;
+  if (header->datac == 0) return (Value *)memory;
+
+  const size_t data_bytes = sizeof(Value) * header->datac;
+  if (header->data_offset % page == 0 &&
+      mmap(memory, _align_up(data_bytes, page), PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fd, header->data_offset) != MAP_FAILED) {
+    // Whatever follows the segment in its last page is not ours.
+    (void)memset(memory + data_bytes, 0, _align_up(data_bytes, page) - data_bytes);
+    goto MAPPED;
+  }
+  if (pread(fd, memory, data_bytes, header->data_offset) != (ssize_t)data_bytes) {
+    (void)munmap(memory, length);
+    return NULL;
+  }
+
+MAPPED:
+#if __BYTE_ORDER__ == __BSWAP_ON
+  _bswap_values_in_place((Value *)memory, header->datac);
+#endif
+  return (Value *)memory;
+}
+
+static bool _image_header_ok(const ProgHeader *header, size_t size)
+{
+  return header->count <= (size - sizeof *header) / sizeof(Inst) &&
+         header->memory_size <= PROG_MAX_MEMORY &&
+         header->datac <= header->memory_size &&
+         header->data_offset <= size &&
+         header->datac <= (size - header->data_offset) / sizeof(Value);
+}
+
+void load_image_from_disk(const char *path, Prog *out)
+{
+  const char* errmsg = NULL;
+  *out = (Prog){0};
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) _DISK_IO_ERROR("could not open file");
+  struct stat st;
+  if (fstat(fd, &st) != 0) _DISK_IO_ERROR("while trying to stat file");
+  const size_t size = st.st_size;
+
+  ProgHeader header = {0};
+  if (size >= sizeof header &&
+      pread(fd, &header, sizeof header, 0) != sizeof header)
+    _DISK_IO_ERROR("while reading header");
+#if __BYTE_ORDER__ == __BSWAP_ON
+  _bswap_header_in_place(&header);
+#endif
+  if (header.magic != PROG_MAGIC) {
+    (void)close(fd);
+    out->code = load_prog_from_disk(path, &out->count);
+    return;
+  }
+
+  errno = EINVAL;
+  if (!_image_header_ok(&header, size)) _DISK_IO_ERROR("malformed program image");
+
+  const size_t code_bytes = sizeof(Inst) * header.count;
+  out->code = malloc(code_bytes);
+  if (out->code == NULL) exit(1);
+  if (pread(fd, out->code, code_bytes, sizeof header) != (ssize_t)code_bytes)
+    _DISK_IO_ERROR("while reading code");
+#if __BYTE_ORDER__ == __BSWAP_ON
+  for (size_t i = 0; i < header.count; i++)
+    _bswap_inst_in_place(out->code + i);
+#endif
+  out->count = header.count;
+
+  if (header.memory_size != 0) {
+    out->memory = map_memory(fd, &header);
+    if (out->memory == NULL) _DISK_IO_ERROR("while mapping linear memory");
+    out->memory_size = header.memory_size;
+    out->datac = header.datac;
+  }
+  (void)close(fd);
+  return;
+
+IO_ERROR:
+  fprintf(stderr, "Error: (operation on %s) %s: %s", path, errmsg, strerror(errno));
+  exit(1);
+}
+
+// Validates an image or plain instruction stream in `bytes` and fills in
+// its header, synthesising one for plain streams.
+static bool _image_from_bytes(const uint8_t *bytes, size_t size,
+                              ProgHeader *header, size_t *code_offset)
+{
+  *header = (ProgHeader){0};
+  (void)memcpy(header, bytes, size < sizeof *header ? size : sizeof *header);
+#if __BYTE_ORDER__ == __BSWAP_ON
+  _bswap_header_in_place(header);
+#endif
+  *code_offset = sizeof *header;
+  // An image cut short inside its header is not a plain stream either.
+  if (header->magic == PROG_MAGIC && size < sizeof *header) return false;
+  if (header->magic != PROG_MAGIC) {
+    if (size % sizeof(Inst) != 0) return false;
+    *header = (ProgHeader){.count = size / sizeof(Inst)};
+    *code_offset = 0;
+    return true;
+  }
+  return _image_header_ok(header, size);
+}
+
+// There is no file to map the data segment from, so copy it.
+static bool _copy_memory(const uint8_t *bytes, const ProgHeader *header, Prog *out)
+{
+  if (header->memory_size == 0) return true;
+  const ProgHeader zeroed = {.memory_size = header->memory_size};
+  out->memory = map_memory(-1, &zeroed);
+  if (out->memory == NULL) return false;
+  (void)memcpy(out->memory, bytes + header->data_offset, sizeof(Value) * header->datac);
+#if __BYTE_ORDER__ == __BSWAP_ON
+  _bswap_values_in_place(out->memory, header->datac);
+#endif
+  out->memory_size = header->memory_size;
+  out->datac = header->datac;
+  return true;
+}
+
+bool load_image_from_bytes(const uint8_t *bytes, size_t size, Prog *out)
+{
+  *out = (Prog){0};
+  ProgHeader header;
+  size_t code_offset;
+  if (!_image_from_bytes(bytes, size, &header, &code_offset)) return false;
+
+  const size_t code_bytes = sizeof(Inst) * header.count;
+  out->code = malloc(code_bytes + 1);
+  if (out->code == NULL) exit(1);
+  (void)memcpy(out->code, bytes + code_offset, code_bytes);
+#if __BYTE_ORDER__ == __BSWAP_ON
+  for (size_t i = 0; i < header.count; i++)
+    _bswap_inst_in_place(out->code + i);
+#endif
+  out->count = header.count;
+  if (!_copy_memory(bytes, &header, out)) exit(1);
+  return true;
+}
+
+bool load_image_in_place(uint8_t *bytes, size_t size, Prog *out)
+{
+  *out = (Prog){0};
+  ProgHeader header;
+  size_t code_offset;
+  if (!_image_from_bytes(bytes, size, &header, &code_offset)) return false;
+
+  out->code = (Inst *)(bytes + code_offset);
+#if __BYTE_ORDER__ == __BSWAP_ON
+  for (size_t i = 0; i < header.count; i++)
+    _bswap_inst_in_place(out->code + i);
+#endif
+  out->count = header.count;
+  return _copy_memory(bytes, &header, out);
+}
+
+void unmap_memory(Value *memory, size_t memory_size)
+{
+  if (memory != NULL)
+    (void)munmap(memory, _memory_mapping_size(memory_size));
+}
+
+void free_image(Prog *prog)
+{
+  unmap_memory(prog->memory, prog->memory_size);
+  free(prog->code);
+  *prog = (Prog){0};
+}
+
 #undef IO_ERROR
@@ -3,10 +3,171 @@
 
 #include "vm.h"
 
+// Programs that use linear memory are stored as an image: a `ProgHeader`,
+// the code, and the initialised data segment at a `PROG_DATA_ALIGN`
+// aligned offset so it can be mapped straight into the VM's memory.
+// Files without the header are plain instruction streams.
+#define PROG_MAGIC 0x314d5653 // "SVM1"
+#define PROG_DATA_ALIGN 16384
+// Linear memory is reserved up front, so its size is capped: 2 GiB.
+#define PROG_MAX_MEMORY ((uint64_t)1 << 28) // in `Value`s
+
+typedef struct {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t count;       // instructions
+  uint64_t memory_size; // in `Value`s
+  uint64_t datac;       // initialised `Value`s at the start of memory
+  uint64_t data_offset; // in bytes from the start of the file
+} ProgHeader;
+
+typedef struct {
+  Inst *code;
+  size_t count;
+  Value *memory;
+  size_t memory_size;
+  size_t datac;
+} Prog;
+
 Inst *copy_prog(const Inst *instructions, size_t count);
 void save_bytes_to_disk(const char *path, const uint8_t *bytes, size_t count);
 uint8_t *load_bytes_from_disk(const char *path, size_t *nread);
 void save_prog_to_disk(const char *path, Inst *instructions, size_t count);
 Inst *load_prog_from_disk(const char *path, size_t *readc_out);
+void save_image_to_disk(const char *path, const Prog *prog);
+void load_image_from_disk(const char *path, Prog *out);
+bool load_image_from_bytes(const uint8_t *bytes, size_t size, Prog *out);
+// Like `load_image_from_bytes`, but `out->code` points into `bytes`, which
+// must outlive it and be aligned for `Inst`. Release with `unmap_memory`.
+bool load_image_in_place(uint8_t *bytes, size_t size, Prog *out);
+void free_image(Prog *prog);
+Value *map_memory(int fd, const ProgHeader *header);
+void unmap_memory(Value *memory, size_t memory_size);
+
+#endif
+
+// Included again by the loader and bundle headers.
+#if defined(_TEST_IMPL) && !defined(_DISK_TESTS)
+#define _DISK_TESTS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+
+static void _assert_same_code(const Inst *a, const Inst *b, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    t_asserteq(a[i].type, b[i].type);
+    t_asserteq(a[i].operand, b[i].operand);
+  }
+}
+
+test(image_round_trip) {
+  char dir[] = "/tmp/disk_test_XXXXXX";
+  t_assert(mkdtemp(dir) != NULL);
+  char path[64], plain[64];
+  sprintf(path, "%s/image.ins", dir);
+  sprintf(plain, "%s/plain.ins", dir);
+
+  Inst code[] = { inst_push(1), inst_load, inst_push(-7), inst_halt };
+  Value data[] = { 7, 8, 9 };
+  // More than a page, so the data segment is mapped rather than read.
+  const Prog image = {.code = code, .count = 4, .memory = data,
+                      .memory_size = 5000, .datac = 3};
+  save_image_to_disk(path, &image);
+
+  Prog loaded;
+  load_image_from_disk(path, &loaded);
+  t_asserteq(loaded.count, 4);
+  _assert_same_code(loaded.code, code, 4);
+  t_asserteq(loaded.memory_size, 5000);
+  t_asserteq(loaded.datac, 3);
+  for (size_t i = 0; i < 3; i++) t_asserteq(loaded.memory[i], data[i]);
+  for (size_t i = 3; i < 5000; i++) t_asserteq(loaded.memory[i], 0);
+  // Memory is a private copy; writing to it leaves the file alone.
+  loaded.memory[0] = 100;
+  loaded.memory[4999] = 100;
+  free_image(&loaded);
+  load_image_from_disk(path, &loaded);
+  t_asserteq(loaded.memory[0], 7);
+  t_asserteq(loaded.memory[4999], 0);
+  free_image(&loaded);
+
+  // Without memory the file is a plain instruction stream.
+  save_prog_to_disk(plain, code, 4);
+  load_image_from_disk(plain, &loaded);
+  t_asserteq(loaded.count, 4);
+  t_assert(loaded.memory == NULL);
+  _assert_same_code(loaded.code, code, 4);
+  free_image(&loaded);
+
+  (void)unlink(path);
+  (void)unlink(plain);
+  (void)rmdir(dir);
+}
+
+test(image_rejects_huge_memory) {
+  struct {
+    ProgHeader header;
+    Inst code[4];
+  } image = {
+    .header = {.magic = PROG_MAGIC, .count = 4, .data_offset = sizeof image},
+    .code = { inst_push(123), inst_push(100000000), inst_store, inst_halt },
+  };
+  Prog prog;
+  // sizeof(Value) times this wraps around to a single page.
+  image.header.memory_size = ((uint64_t)1 << 61) + 1;
+  t_assert(!load_image_from_bytes((const uint8_t *)&image, sizeof image, &prog));
+  image.header.memory_size = PROG_MAX_MEMORY + 1;
+  t_assert(!load_image_from_bytes((const uint8_t *)&image, sizeof image, &prog));
+  image.header.memory_size = 16;
+  t_assert(load_image_from_bytes((const uint8_t *)&image, sizeof image, &prog));
+  t_asserteq(prog.memory_size, 16);
+  free_image(&prog);
+}
+
+test(image_from_bytes_rejects_malformed) {
+  struct {
+    ProgHeader header;
+    Inst code[2];
+    Value data[2];
+  } image = {
+    .header = {.magic = PROG_MAGIC, .count = 2, .memory_size = 4, .datac = 2,
+               .data_offset = sizeof(ProgHeader) + 2 * sizeof(Inst)},
+    .code = { inst_push(0), inst_load },
+    .data = { 5, 6 },
+  };
+  const uint8_t *bytes = (const uint8_t *)&image;
+  Prog prog;
+  t_assert(load_image_from_bytes(bytes, sizeof image, &prog));
+  t_asserteq(prog.count, 2);
+  t_asserteq(prog.memory[1], 6);
+  t_asserteq(prog.memory[3], 0);
+  free_image(&prog);
+
+  // Cut short inside the data, the code and the header.
+  t_assert(!load_image_from_bytes(bytes, sizeof image - 1, &prog));
+  t_assert(!load_image_from_bytes(bytes, sizeof image.header + sizeof(Inst), &prog));
+  t_assert(!load_image_from_bytes(bytes, sizeof image.header - 8, &prog));
+  image.header.count = 4;
+  t_assert(!load_image_from_bytes(bytes, sizeof image, &prog));
+  image.header.count = 2;
+  image.header.datac = 5;
+  t_assert(!load_image_from_bytes(bytes, sizeof image, &prog));
+  image.header.datac = 2;
+  image.header.data_offset = sizeof image + 8;
+  t_assert(!load_image_from_bytes(bytes, sizeof image, &prog));
+  image.header.data_offset = UINT64_MAX;
+  t_assert(!load_image_from_bytes(bytes, sizeof image, &prog));
 
+  // Without the magic it is a plain stream, which must be whole
+  // instructions; an empty one loads as no code at all.
+  Inst code[] = { inst_push(1), inst_halt };
+  t_assert(!load_image_from_bytes((const uint8_t *)code, sizeof code - 1, &prog));
+  t_assert(load_image_from_bytes((const uint8_t *)code, 0, &prog));
+  t_asserteq(prog.count, 0);
+  free_image(&prog);
+}
 #endif
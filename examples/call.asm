@@ -0,0 +1,9 @@
+        push 3
+        call 5
+        push 4
+        call 3
+        add
+        halt
+        dup 0
+        mul
+        ret
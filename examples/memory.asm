@@ -0,0 +1,22 @@
+        .memory 64
+        .data 10 20 30 40
+        push 2
+        load
+        push 7
+        store
+        push 8
+        push 0
+        push 4
+        memcpy
+        push 16
+        push -1
+        push 8
+        memset
+        push 11
+        load
+        push 7
+        load
+        push 16
+        load
+        add
+        halt
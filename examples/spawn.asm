@@ -0,0 +1,13 @@
+        push 6
+        push 1
+        spawn 8
+        push 7
+        push 1
+        spawn 5
+        join
+        dup 1
+        join
+        halt
+        dup 0
+        mul
+        halt
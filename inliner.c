@@ -0,0 +1,93 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inliner.h"
+#include "vm.h"
+
+static bool _is_branch(inst_t type)
+{
+  return type == INST_JMP || type == INST_JZ ||
+         type == INST_JNZ || type == INST_CALL || type == INST_SPAWN;
+}
+
+// Where a relative branch at `at` lands, wrapping as the VM's `ip` does.
+static Value _target(size_t at, Value operand)
+{
+  return (Value)((uint64_t)at + (uint64_t)operand);
+}
+
+// Operand for a branch now at `at` whose target was outside the `count`
+// instructions of the original: as far before the start or past the end
+// of the `total` new ones, so it faults as before instead of landing on
+// code that inlining moved there.
+static Value _outside_operand(Value target, size_t count, size_t total, size_t at)
+{
+  uint64_t moved = (uint64_t)target;
+  if (target > 0) moved += (uint64_t)total - (uint64_t)count;
+  return (Value)(moved - (uint64_t)at);
+}
+
+size_t callee_length(const Inst *code, size_t count, size_t target, size_t max)
+{
+  for (size_t i = target; i < count && i - target <= max; i++) {
+    inst_t type = code[i].type;
+    if (type == INST_RET) return i - target;
+    if (_is_branch(type) || type == INST_HALT) return SIZE_MAX;
+  }
+  return SIZE_MAX;
+}
+
+Inst *inline_calls(const Inst *code, size_t count, const size_t *calls,
+                   size_t *out_count)
+{
+  size_t *inlined = malloc(sizeof(size_t) * (count + 1));
+  size_t *remap = malloc(sizeof(size_t) * (count + 1));
+  if (inlined == NULL || remap == NULL) exit(1);
+
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    const Inst inst = code[i];
+    const Value target = _target(i, inst.operand);
+    remap[i] = total;
+    inlined[i] = SIZE_MAX;
+    if (inst.type == INST_CALL && target >= 0 && (size_t)target < count) {
+      const bool hot = calls != NULL && calls[i] >= INLINE_HOT_CALLS;
+      inlined[i] = callee_length(code, count, target,
+                                 hot ? INLINE_MAX_HOT : INLINE_MAX_COLD);
+    }
+    total += inlined[i] == SIZE_MAX ? 1 : inlined[i];
+  }
+  remap[count] = total;
+
+  // Zeroed, and written field-wise below, so the padding after `type`
+  // stays zero and the output is the same bytes on every build.
+  Inst *out = calloc(total + 1, sizeof(Inst));
+  if (out == NULL) exit(1);
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    const Inst inst = code[i];
+    const Value target = _target(i, inst.operand);
+    if (inlined[i] != SIZE_MAX) {
+      for (size_t k = 0; k < inlined[i]; k++, n++) {
+        out[n].type = code[target + k].type;
+        out[n].operand = code[target + k].operand;
+      }
+      continue;
+    }
+    out[n].type = inst.type;
+    out[n].operand = inst.operand;
+    if (_is_branch(inst.type) && target >= 0 && (size_t)target <= count)
+      out[n].operand = (Value)remap[target] - (Value)remap[i];
+    else if (_is_branch(inst.type))
+      out[n].operand = _outside_operand(target, count, total, remap[i]);
+    n++;
+  }
+
+  free(inlined);
+  free(remap);
+  *out_count = total;
+  return out;
+}
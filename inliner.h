@@ -0,0 +1,169 @@
+#ifndef _INLINER_H
+#define _INLINER_H
+
+#include <stddef.h>
+
+#include "vm.h"
+
+// Callees of at most `INLINE_MAX_COLD` instructions are inlined at every
+// call site. Call sites that a profile (see `interpreter -p`) shows were
+// executed at least `INLINE_HOT_CALLS` times also take callees of up to
+// `INLINE_MAX_HOT` instructions.
+#define INLINE_MAX_COLD 8
+#define INLINE_MAX_HOT 64
+#define INLINE_HOT_CALLS 1000
+
+// Length of the callee starting at `target` if it is a straight-line run
+// of at most `max` instructions ending in `ret`, or SIZE_MAX otherwise.
+size_t callee_length(const Inst *code, size_t count, size_t target, size_t max);
+
+// Returns a copy of `code` in which calls to small callees are replaced
+// with the callee body (minus its `ret`), with every relative branch
+// re-targeted around the new layout. The callees themselves stay where
+// they are, since they may still be reached from call sites that were not
+// inlined. `calls`, if not NULL, holds how often each call site ran.
+Inst *inline_calls(const Inst *code, size_t count, const size_t *calls,
+                   size_t *out_count);
+
+#endif // _INLINER_H
+
+#ifdef _TEST_IMPL
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+// Runs `code` before and after inlining and expects the same outcome.
+static Inst *_assert_inlining_agrees(Inst *code, size_t count,
+                                     const size_t *calls, size_t *out_count)
+{
+  Inst *inlined = inline_calls(code, count, calls, out_count);
+  static VM before, after;
+  before = (VM){.code = code, .count = count};
+  after = (VM){.code = inlined, .count = *out_count};
+  t_asserteq(vm_run(&after), vm_run(&before));
+  t_asserteq(after.sp, before.sp);
+  for (size_t i = 0; i < before.sp; i++) t_asserteq(after.stack[i], before.stack[i]);
+  return inlined;
+}
+
+test(inline_branches_across_sites) {
+  Inst code[] = {
+    inst_push(5),
+    inst_call(9),   // inlined as `push -1, add`
+    inst_call(10),  // bare `ret`, so nothing is left of this one
+    inst_dup(0),
+    inst_jnz(-3),   // back over both sites
+    inst_jmp(2),
+    inst_halt,
+    inst_call(6),   // has a branch, so stays a call
+    inst_jmp(-2),
+    inst_halt,
+    inst_push(-1),
+    inst_add,
+    inst_ret,
+    inst_push(7),
+    inst_jmp(2),
+    inst_nop,
+    inst_ret,
+  };
+  size_t count;
+  Inst *inlined = _assert_inlining_agrees(code, 17, NULL, &count);
+  t_asserteq(count, 17);
+  t_asserteq(inlined[1].type, INST_PUSH);
+  t_asserteq(inlined[1].operand, -1);
+  t_asserteq(inlined[2].type, INST_ADD);
+  t_asserteq(inlined[3].type, INST_DUP);
+  t_asserteq(inlined[4].type, INST_JNZ);
+  t_asserteq(inlined[4].operand, -3);
+  t_asserteq(inlined[7].type, INST_CALL);
+  t_asserteq(inlined[7].operand, 6);
+  free(inlined);
+}
+
+test(inline_branch_to_removed_site) {
+  // Jumping to a call of a bare `ret` lands on whatever followed it.
+  Inst code[] = {
+    inst_push(0),
+    inst_jz(2),
+    inst_push(1),
+    inst_call(3),
+    inst_push(2),
+    inst_halt,
+    inst_ret,
+  };
+  size_t count;
+  Inst *inlined = _assert_inlining_agrees(code, 7, NULL, &count);
+  t_asserteq(count, 6);
+  t_asserteq(inlined[1].operand, 2);
+  t_asserteq(inlined[3].type, INST_PUSH);
+  t_asserteq(inlined[3].operand, 2);
+  free(inlined);
+}
+
+test(inline_keeps_branches_out_of_range) {
+  // Both sites grow by one, which would bring each jump back into range.
+  Inst before_start[] = {
+    inst_call(3),
+    inst_jmp(-2),
+    inst_halt,
+    inst_push(7),
+    inst_push(8),
+    inst_ret,
+  };
+  size_t count;
+  Inst *inlined = _assert_inlining_agrees(before_start, 6, NULL, &count);
+  t_asserteq(count, 7);
+  t_asserteq(inlined[2].operand, -3);
+  free(inlined);
+
+  Inst past_end[] = {
+    inst_jmp(7),
+    inst_call(2),
+    inst_halt,
+    inst_push(7),
+    inst_push(8),
+    inst_ret,
+  };
+  inlined = _assert_inlining_agrees(past_end, 6, NULL, &count);
+  t_asserteq(count, 7);
+  t_asserteq(inlined[0].operand, 8);
+  free(inlined);
+}
+
+// Instructions after inlining a callee of `length` instructions at one
+// call site that ran `hits` times.
+static size_t _inlined_size(size_t length, size_t hits)
+{
+  Inst code[INLINE_MAX_HOT + 4];
+  code[0] = inst_call(2);
+  code[1] = inst_halt;
+  for (size_t i = 0; i < length; i++) code[2 + i] = inst_push(i);
+  code[2 + length] = inst_ret;
+  const size_t calls[INLINE_MAX_HOT + 4] = {[0] = hits};
+  size_t count;
+  free(_assert_inlining_agrees(code, length + 3, calls, &count));
+  return count;
+}
+
+test(inline_hot_and_cold_thresholds) {
+  // Inlined, the call becomes a copy of the callee: 2 * length + 2.
+  t_asserteq(_inlined_size(INLINE_MAX_COLD, 0), 2 * INLINE_MAX_COLD + 2);
+  t_asserteq(_inlined_size(INLINE_MAX_COLD + 1, 0), INLINE_MAX_COLD + 4);
+  t_asserteq(_inlined_size(INLINE_MAX_COLD + 1, INLINE_HOT_CALLS - 1), INLINE_MAX_COLD + 4);
+  t_asserteq(_inlined_size(INLINE_MAX_COLD + 1, INLINE_HOT_CALLS), 2 * INLINE_MAX_COLD + 4);
+  t_asserteq(_inlined_size(INLINE_MAX_HOT, INLINE_HOT_CALLS), 2 * INLINE_MAX_HOT + 2);
+  t_asserteq(_inlined_size(INLINE_MAX_HOT + 1, INLINE_HOT_CALLS), INLINE_MAX_HOT + 4);
+}
+
+test(inline_callee_length) {
+  Inst code[] = { inst_push(1), inst_ret, inst_push(1), inst_halt, inst_jz(1), inst_ret, inst_nop };
+  t_asserteq(callee_length(code, 7, 0, INLINE_MAX_COLD), 1);
+  t_asserteq(callee_length(code, 7, 1, INLINE_MAX_COLD), 0);
+  t_asserteq(callee_length(code, 7, 0, 0), SIZE_MAX);
+  t_asserteq(callee_length(code, 7, 2, INLINE_MAX_COLD), SIZE_MAX);
+  t_asserteq(callee_length(code, 7, 4, INLINE_MAX_COLD), SIZE_MAX);
+  // Runs off the end.
+  t_asserteq(callee_length(code, 7, 6, INLINE_MAX_COLD), SIZE_MAX);
+}
+#endif
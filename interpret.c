@@ -1,26 +1,193 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "vm.h"
 #include "disk.h"
+#include "bundle.h"
+#include "pool.h"
+#include "regvm.h"
+#include "channel.h"
+#include "spmd.h"
 
-const char *filepath = "examples/negative.ins";
+// Same as `vm_run`, but counts how often each `call` instruction executes.
+static vm_err_t run_profiled(VM *vm, size_t *calls)
+{
+  while (!vm->halted) {
+    if (vm->ip >= vm->count) return VM_ERR_IP_OUT_OF_BOUNDS;
+    const Inst inst = vm->code[vm->ip];
+    if (inst.type == INST_CALL) calls[vm->ip]++;
+    vm_err_t result = vm_exec(vm, inst);
+    if (result != VM_ERR_NONE) return result;
+  }
+  return VM_ERR_NONE;
+}
+
+static void save_profile(const char *path, const size_t *calls, size_t count)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Error: could not open profile %s\n", path);
+    exit(1);
+  }
+  for (size_t ip = 0; ip < count; ip++)
+    if (calls[ip] != 0) fprintf(file, "%zu %zu\n", ip, calls[ip]);
+  (void)fclose(file);
+}
+
+// Runs the program once per line of `path` in lockstep (see spmd.h). A
+// line lists the lane's starting stack, bottom first.
+static int run_lanes(const Prog *prog, const char *path, Channel *channel)
+{
+  size_t size;
+  char *text = (char *)load_bytes_from_disk(path, &size);
+  size_t lanes = 0;
+  for (size_t i = 0; i < size; i++) lanes += text[i] == '\n';
+  if (size != 0 && text[size - 1] != '\n') lanes++;
+
+  SPMD s;
+  spmd_init(&s, prog->code, prog->count, lanes);
+  const char *cursor = text;
+  for (size_t lane = 0; lane < lanes; lane++) {
+    const char *end = strchr(cursor, '\n');
+    if (end == NULL) end = text + size;
+    while (cursor < end) {
+      if (*cursor == ' ' || *cursor == '\t' || *cursor == '\r') {
+        cursor++;
+        continue;
+      }
+      char *next;
+      const Value value = strtoll(cursor, &next, 0);
+      if (next == cursor) {
+        fprintf(stderr, "Error: %s:%zu: expected a value\n", path, lane + 1);
+        exit(1);
+      }
+      if (spmd_push(&s, lane, value) != VM_ERR_NONE) {
+        fprintf(stderr, "Error: %s:%zu: too many values\n", path, lane + 1);
+        exit(1);
+      }
+      cursor = next;
+    }
+    cursor = end + 1;
+  }
+  free(text);
+  spmd_run(&s);
+
+  int status = 0;
+  VM vm = {0};
+  for (size_t lane = 0; lane < lanes; lane++) {
+    spmd_lane_to_vm(&s, lane, &vm);
+    const vm_err_t result = s.error[lane];
+    if (channel->header != NULL) {
+      if (!channel_push(channel, lane, result, vm.stack, result == VM_ERR_NONE ? vm.sp : 0)) {
+        fprintf(stderr, "Error: result does not fit the channel\n");
+        exit(1);
+      }
+    } else if (result == VM_ERR_NONE) {
+      dump_stack(&vm);
+    }
+    if (result != VM_ERR_NONE) {
+      printf("Error in lane %zu: %s\n", lane, vm_err_to_cstr(result));
+      status = 1;
+    }
+  }
+  spmd_free(&s);
+  return status;
+}
 
 int main(int argc, const char *argv[])
 {
-  if (argc != 2) {
+  const char *profile = NULL;
+  const char *filepath = NULL;
+  const char *bundle_path = NULL;
+  const char *channel_name = NULL;
+  const char *lanes_path = NULL;
+  size_t workers = 0;
+  bool registers = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) profile = argv[++i];
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) bundle_path = argv[++i];
+    else if (strcmp(argv[i], "-r") == 0) registers = true;
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) channel_name = argv[++i];
+    else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) lanes_path = argv[++i];
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) workers = strtoul(argv[++i], NULL, 10);
+    else if (filepath == NULL) filepath = argv[i];
+    else { filepath = NULL; break; }
+  }
+  if (filepath == NULL) {
     fprintf(stderr,
             "Error: expected path to bytecode file\n"
-            "Usage: %s <filepath>",
-            argv[0]);
+            "Usage: %s [-r] [-c <channel>] [-p <profile>] [-j <threads>] <filepath>\n"
+            "       %s [-r] [-c <channel>] [-p <profile>] [-j <threads>] -b <bundle> <name>\n"
+            "       %s [-c <channel>] -l <lanes> <filepath>",
+            argv[0], argv[0], argv[0]);
     return 1;
   }
 
-  size_t nread;
-  Inst *code = load_prog_from_disk(argv[1], &nread);
+  // With a result channel (see channel.h) the final stack goes there,
+  // tagged with our pid, instead of to stdout.
+  Channel channel = {.fd = -1};
+  if (channel_name != NULL && !channel_open(channel_name, &channel)) {
+    fprintf(stderr, "Error: could not open result channel %s\n", channel_name);
+    return 1;
+  }
+
+  Prog prog;
+  if (bundle_path != NULL) {
+    Bundle bundle;
+    bundle_open(bundle_path, &bundle);
+    const BundleEntry *entry = bundle_find(&bundle, filepath);
+    if (entry == NULL) {
+      fprintf(stderr, "Error: no program named %s in %s\n", filepath, bundle_path);
+      return 1;
+    }
+    bundle_load(&bundle, entry, &prog);
+  } else {
+    load_image_from_disk(filepath, &prog);
+  }
+  if (prog.count == 0) {
+    fprintf(stderr, "Error: %s has no code\n", filepath);
+    return 1;
+  }
+  if (lanes_path != NULL) {
+    const int status = run_lanes(&prog, lanes_path, &channel);
+    if (channel_name != NULL) channel_close(&channel);
+    return status;
+  }
   VM vm = {0};
-  vm.code = code;
+  vm.code = prog.code;
+  vm.count = prog.count;
+  vm.memory = prog.memory;
+  vm.memory_size = prog.memory_size;
+  // Without worker threads, spawned children run inline.
+  vm.pool = workers ? pool_new(workers) : NULL;
+
+  size_t *calls = NULL;
+  if (profile != NULL) {
+    calls = calloc(prog.count, sizeof(size_t));
+    if (calls == NULL) exit(1);
+  }
+
+  // Programs the register engine cannot take quietly run on the stack VM.
+  RProg rprog = {0};
+  if (registers && calls == NULL)
+    registers = rvm_translate(prog.code, prog.count, 0, 0, &rprog);
 
-  vm_err_t result = vm_run(&vm);
+  vm_err_t result = calls      ? run_profiled(&vm, calls)
+                    : registers ? rvm_run(&rprog, &vm)
+                                : vm_run(&vm);
+  if (registers) rvm_free(&rprog);
+  pool_reap(vm.pool, &vm);
+  if (calls != NULL) save_profile(profile, calls, prog.count);
+  if (channel_name != NULL) {
+    const size_t count = result == VM_ERR_NONE ? vm.sp : 0;
+    if (!channel_push(&channel, getpid(), result, vm.stack, count)) {
+      fprintf(stderr, "Error: result does not fit channel %s\n", channel_name);
+      return 1;
+    }
+    channel_close(&channel);
+  }
   if (result != VM_ERR_NONE) {
     printf("Error while interpreting %s: %s\n",
            filepath,
@@ -28,6 +195,6 @@ int main(int argc, const char *argv[])
     return 1;
   }
 
-  dump_stack(&vm);
+  if (channel_name == NULL) dump_stack(&vm);
   return 0;
 }
@@ -0,0 +1,444 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "disk.h"
+#include "loader.h"
+
+#define LOAD_THREADS 16
+// Reads are split so a length always fits the 32-bit `len` of a request.
+#define LOAD_MAX_READ (1u << 30)
+
+typedef struct {
+  const char *path;
+  int fd;
+  int error;
+  size_t size;
+  size_t offset; // in the arena
+  size_t done;   // bytes read so far
+#ifdef __linux__
+  struct statx statx;
+#endif
+} _File;
+
+static inline size_t _align_up(size_t value, size_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static void _fail(_File *file, int error)
+{
+  if (file->error == 0) file->error = error;
+}
+
+// A file that got shorter since it was sized is as bad as one that fails
+// to read.
+static void _read_done(_File *file, ssize_t n)
+{
+  if (n < 0) _fail(file, errno);
+  else if (n == 0) _fail(file, EIO);
+  else file->done += n;
+}
+
+static bool _wants_read(const _File *file)
+{
+  return file->error == 0 && file->done < file->size;
+}
+
+// Threads ---------------------------------------------------------------
+
+typedef struct {
+  _File *files;
+  size_t count;
+  uint8_t *arena; // NULL while sizing
+  atomic_size_t next;
+} _Work;
+
+static void *_worker(void *arg)
+{
+  _Work *work = arg;
+  for (;;) {
+    const size_t i = atomic_fetch_add(&work->next, 1);
+    if (i >= work->count) return NULL;
+    _File *file = &work->files[i];
+
+    if (work->arena == NULL) {
+      struct stat st;
+      if (stat(file->path, &st) != 0) _fail(file, errno);
+      else file->size = st.st_size;
+      continue;
+    }
+    if (!_wants_read(file)) continue;
+    file->fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0) {
+      _fail(file, errno);
+      continue;
+    }
+    while (_wants_read(file)) {
+      const size_t want = file->size - file->done;
+      _read_done(file, pread(file->fd, work->arena + file->offset + file->done,
+                             want < LOAD_MAX_READ ? want : LOAD_MAX_READ, file->done));
+    }
+    (void)close(file->fd);
+    file->fd = -1;
+  }
+}
+
+static void _threads_run(_File *files, size_t count, uint8_t *arena)
+{
+  _Work work = {.files = files, .count = count, .arena = arena};
+  atomic_init(&work.next, 0);
+  pthread_t threads[LOAD_THREADS];
+  size_t started = 0;
+  for (; started < LOAD_THREADS && started < count; started++)
+    if (pthread_create(&threads[started], NULL, _worker, &work) != 0) break;
+  // Whatever is left if no thread could start is done here.
+  if (started == 0) (void)_worker(&work);
+  for (size_t i = 0; i < started; i++) (void)pthread_join(threads[i], NULL);
+}
+
+// io_uring --------------------------------------------------------------
+//
+// Set up with raw syscalls; there is no dependency on liburing. Each file
+// has at most one request in flight: `statx` while sizing, then `openat`,
+// one or more `read`s and `close`. A request's `user_data` is the file
+// index and the operation.
+
+#ifdef __linux__
+
+typedef enum {
+  _OP_STATX,
+  _OP_OPEN,
+  _OP_READ,
+  _OP_CLOSE,
+  _OP_NONE,
+} _op_t;
+
+typedef struct {
+  int fd;
+  unsigned entries;
+  _Atomic uint32_t *sq_head, *sq_tail;
+  uint32_t sq_mask, *sq_array;
+  _Atomic uint32_t *cq_head, *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+} _Ring;
+
+static void _ring_close(_Ring *ring)
+{
+  if (ring->sqes != NULL) (void)munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    (void)munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL) (void)munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0) (void)close(ring->fd);
+  *ring = (_Ring){.fd = -1};
+}
+
+// Kernels before 5.6 set up a ring but fail every `statx` and `openat`
+// on it, and cannot be probed either.
+static bool _ring_supports_ops(int fd)
+{
+  static const uint8_t needed[] = {
+    IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE,
+  };
+  const unsigned ops = 256;
+  struct io_uring_probe *probe =
+    calloc(1, sizeof *probe + ops * sizeof(struct io_uring_probe_op));
+  if (probe == NULL) exit(1);
+  bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, ops) == 0;
+  for (size_t i = 0; ok && i < sizeof needed; i++)
+    ok = needed[i] < probe->ops_len &&
+         (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+static bool _ring_open(_Ring *ring)
+{
+  *ring = (_Ring){.fd = -1};
+  struct io_uring_params params = {0};
+  ring->fd = syscall(__NR_io_uring_setup, LOAD_MAX_IN_FLIGHT, &params);
+  if (ring->fd < 0) return false;
+  if (!_ring_supports_ops(ring->fd)) goto FAIL;
+  ring->entries = params.sq_entries < LOAD_MAX_IN_FLIGHT ? params.sq_entries : LOAD_MAX_IN_FLIGHT;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ring->cq_ring_size > ring->sq_ring_size)
+    ring->sq_ring_size = ring->cq_ring_size;
+
+  void *sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) goto FAIL;
+  ring->sq_ring = sq;
+  void *cq = sq;
+  if (!single) {
+    cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) goto FAIL;
+  }
+  ring->cq_ring = cq;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) goto FAIL;
+  ring->sqes = sqes;
+
+  ring->sq_head = (_Atomic uint32_t *)((char *)sq + params.sq_off.head);
+  ring->sq_tail = (_Atomic uint32_t *)((char *)sq + params.sq_off.tail);
+  ring->sq_mask = *(uint32_t *)((char *)sq + params.sq_off.ring_mask);
+  ring->sq_array = (uint32_t *)((char *)sq + params.sq_off.array);
+  ring->cq_head = (_Atomic uint32_t *)((char *)cq + params.cq_off.head);
+  ring->cq_tail = (_Atomic uint32_t *)((char *)cq + params.cq_off.tail);
+  ring->cq_mask = *(uint32_t *)((char *)cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)cq + params.cq_off.cqes);
+  return true;
+
+FAIL:
+  _ring_close(ring);
+  return false;
+}
+
+static _op_t _first_op(const _File *file, bool sizing)
+{
+  if (sizing) return _OP_STATX;
+  return _wants_read(file) ? _OP_OPEN : _OP_NONE;
+}
+
+static void _prep(struct io_uring_sqe *sqe, _File *file, uint8_t *arena,
+                  size_t index, _op_t op)
+{
+  (void)memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = op == _OP_STATX  ? IORING_OP_STATX
+                : op == _OP_OPEN ? IORING_OP_OPENAT
+                : op == _OP_READ ? IORING_OP_READ
+                                 : IORING_OP_CLOSE;
+  sqe->user_data = (uint64_t)index << 2 | op;
+  switch (op) {
+  case _OP_STATX:
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)file->path;
+    sqe->len = STATX_SIZE;
+    sqe->off = (uintptr_t)&file->statx;
+    break;
+  case _OP_OPEN:
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)file->path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    break;
+  case _OP_READ: {
+    const size_t want = file->size - file->done;
+    sqe->fd = file->fd;
+    sqe->addr = (uintptr_t)(arena + file->offset + file->done);
+    sqe->len = want < LOAD_MAX_READ ? want : LOAD_MAX_READ;
+    sqe->off = file->done;
+  } break;
+  case _OP_CLOSE: sqe->fd = file->fd; break;
+  case _OP_NONE: break;
+  }
+}
+
+static _op_t _complete(_File *file, _op_t op, int32_t res)
+{
+  switch (op) {
+  case _OP_STATX:
+    if (res < 0) _fail(file, -res);
+    else file->size = file->statx.stx_size;
+    return _OP_NONE;
+  case _OP_OPEN:
+    if (res < 0) _fail(file, -res);
+    else file->fd = res;
+    return res < 0 ? _OP_NONE : _OP_READ;
+  case _OP_READ:
+    errno = res < 0 ? -res : 0;
+    _read_done(file, res < 0 ? -1 : res);
+    return _wants_read(file) ? _OP_READ : _OP_CLOSE;
+  case _OP_CLOSE: file->fd = -1; return _OP_NONE;
+  case _OP_NONE: return _OP_NONE;
+  }
+  return _OP_NONE;
+}
+
+// Closing the ring does not wait for its requests, and the kernel would
+// go on writing into `files` and the arena for those still in flight, so
+// wait for all of them before the stage is redone without the ring. Of
+// what completes only the descriptors are kept track of, for the caller to
+// close. If even waiting fails, nothing is safe to reuse.
+static void _uring_drain(_Ring *ring, _File *files, size_t in_flight)
+{
+  for (;;) {
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    const uint32_t cq_tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    for (; head != cq_tail; head++, in_flight--) {
+      const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+      _File *file = &files[cqe->user_data >> 2];
+      const _op_t op = cqe->user_data & 3;
+      if (op == _OP_OPEN && cqe->res >= 0) file->fd = cqe->res;
+      if (op == _OP_CLOSE) file->fd = -1;
+    }
+    atomic_store_explicit(ring->cq_head, head, memory_order_release);
+    if (in_flight == 0) return;
+    if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      exit(1);
+  }
+}
+
+// Runs one stage over every file. Returns false if the ring itself broke,
+// after which the stage has to be redone without it.
+static bool _uring_run(_Ring *ring, _File *files, size_t count, uint8_t *arena)
+{
+  const bool sizing = arena == NULL;
+  // Follow-up requests of files that are in progress.
+  uint64_t ready[LOAD_MAX_IN_FLIGHT];
+  size_t readyc = 0, next = 0, in_flight = 0, unsubmitted = 0;
+
+  for (;;) {
+    uint32_t tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    while (in_flight + unsubmitted < ring->entries) {
+      size_t index;
+      _op_t op;
+      if (readyc != 0) {
+        index = ready[--readyc] >> 2;
+        op = ready[readyc] & 3;
+      } else if (next < count) {
+        index = next++;
+        op = _first_op(&files[index], sizing);
+        if (op == _OP_NONE) continue;
+      } else {
+        break;
+      }
+      const uint32_t slot = tail & ring->sq_mask;
+      _prep(&ring->sqes[slot], &files[index], arena, index, op);
+      ring->sq_array[slot] = slot;
+      tail++;
+      unsubmitted++;
+    }
+    atomic_store_explicit(ring->sq_tail, tail, memory_order_release);
+    if (in_flight + unsubmitted == 0) return true;
+
+    const int submitted = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1,
+                                  IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      _uring_drain(ring, files, in_flight);
+      _ring_close(ring);
+      return false;
+    }
+    if (submitted > 0) {
+      in_flight += submitted;
+      unsubmitted -= submitted;
+    }
+
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    const uint32_t cq_tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    for (; head != cq_tail; head++, in_flight--) {
+      const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+      const size_t index = cqe->user_data >> 2;
+      const _op_t then = _complete(&files[index], cqe->user_data & 3, cqe->res);
+      if (then != _OP_NONE) ready[readyc++] = (uint64_t)index << 2 | then;
+    }
+    atomic_store_explicit(ring->cq_head, head, memory_order_release);
+  }
+}
+
+#endif // __linux__
+
+// -----------------------------------------------------------------------
+
+static void _reset_reads(_File *files, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    if (files[i].fd >= 0) (void)close(files[i].fd);
+    files[i].fd = -1;
+    files[i].done = 0;
+  }
+}
+
+void load_batch(const char *const *paths, size_t count, load_flags_t flags,
+                LoadBatch *out)
+{
+  *out = (LoadBatch){.count = count};
+  out->results = calloc(count + 1, sizeof(LoadResult));
+  _File *files = calloc(count + 1, sizeof(_File));
+  if (out->results == NULL || files == NULL) exit(1);
+  for (size_t i = 0; i < count; i++) files[i] = (_File){.path = paths[i], .fd = -1};
+
+  bool uring = false;
+#ifdef __linux__
+  _Ring ring = {.fd = -1};
+  uring = !(flags & LOAD_NO_URING) && _ring_open(&ring);
+  if (uring && !_uring_run(&ring, files, count, NULL)) uring = false;
+#else
+  (void)flags;
+#endif
+  if (!uring) _threads_run(files, count, NULL);
+
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (files[i].error != 0) continue;
+    files[i].offset = size;
+    size = _align_up(size + files[i].size, LOAD_ALIGN);
+  }
+  // Faulting the arena in 4 KiB pages costs about as much as reading
+  // into it from the page cache, so ask for huge pages.
+  out->arena_size = size ? size : LOAD_ALIGN;
+  void *arena = mmap(NULL, out->arena_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED) exit(1);
+#ifdef MADV_HUGEPAGE
+  (void)madvise(arena, out->arena_size, MADV_HUGEPAGE);
+#endif
+  out->arena = arena;
+
+#ifdef __linux__
+  if (uring && !_uring_run(&ring, files, count, out->arena)) {
+    uring = false;
+    _reset_reads(files, count);
+  }
+  _ring_close(&ring);
+#endif
+  if (!uring) _threads_run(files, count, out->arena);
+
+  for (size_t i = 0; i < count; i++) {
+    LoadResult *result = &out->results[i];
+    result->error = files[i].error;
+    if (result->error == 0 &&
+        !load_image_in_place(out->arena + files[i].offset, files[i].size, &result->prog)) {
+      result->prog = (Prog){0};
+      result->error = EINVAL;
+    }
+    out->failed += result->error != 0;
+  }
+  free(files);
+}
+
+void load_batch_free(LoadBatch *batch)
+{
+  for (size_t i = 0; i < batch->count; i++) {
+    const Prog *prog = &batch->results[i].prog;
+    unmap_memory(prog->memory, prog->memory_size);
+  }
+  free(batch->results);
+  if (batch->arena != NULL) (void)munmap(batch->arena, batch->arena_size);
+  *batch = (LoadBatch){0};
+}
@@ -0,0 +1,100 @@
+#ifndef _LOADER_H
+#define _LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk.h"
+
+// Loads a batch of program files at once. The sizes of all files are
+// looked up first so their contents can share one arena, then every file
+// is opened, read and closed, with up to LOAD_MAX_IN_FLIGHT files in
+// progress at a time. On Linux the syscalls go through io_uring so the
+// device queue stays full without a thread per request; elsewhere, or
+// when io_uring is not available, a few threads make them one by one.
+//
+// A file that cannot be loaded does not stop the others: its `error` is
+// the errno of the call that failed (EINVAL for a malformed image) and
+// its `prog` is left empty. Code is used in place in the arena, so the
+// programs live until `load_batch_free`.
+#define LOAD_MAX_IN_FLIGHT 256
+#define LOAD_ALIGN 64
+
+typedef enum {
+  LOAD_DEFAULT = 0,
+  LOAD_NO_URING = 1 << 0,
+} load_flags_t;
+
+typedef struct {
+  Prog prog;
+  int error;
+} LoadResult;
+
+typedef struct {
+  uint8_t *arena;
+  size_t arena_size;
+  LoadResult *results; // one per path, in order
+  size_t count;
+  size_t failed;
+} LoadBatch;
+
+void load_batch(const char *const *paths, size_t count, load_flags_t flags,
+                LoadBatch *out);
+void load_batch_free(LoadBatch *batch);
+
+#endif // _LOADER_H
+
+#ifdef _TEST_IMPL
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+
+static void _assert_loads(load_flags_t flags)
+{
+  char dir[] = "/tmp/loader_test_XXXXXX";
+  t_assert(mkdtemp(dir) != NULL);
+  char paths[5][64];
+  for (size_t i = 0; i < 5; i++) sprintf(paths[i], "%s/%zu.ins", dir, i);
+
+  Inst code[] = { inst_push(1), inst_push(2), inst_add, inst_halt };
+  save_prog_to_disk(paths[0], code, 4);
+  Value data[] = { 7, 8, 9 };
+  const Prog image = {.code = code, .count = 4, .memory = data,
+                      .memory_size = 10, .datac = 3};
+  save_image_to_disk(paths[1], &image);
+  save_bytes_to_disk(paths[2], (const uint8_t *)"not a program", 13);
+  save_bytes_to_disk(paths[4], (const uint8_t *)"", 0);
+
+  const char *list[] = { paths[0], paths[1], paths[2], paths[3], paths[4] };
+  LoadBatch batch;
+  load_batch(list, 5, flags, &batch);
+  t_asserteq(batch.failed, 2);
+  t_asserteq(batch.results[0].error, 0);
+  t_asserteq(batch.results[0].prog.count, 4);
+  t_asserteq(batch.results[0].prog.code[2].type, INST_ADD);
+  t_asserteq(batch.results[1].error, 0);
+  t_asserteq(batch.results[1].prog.memory_size, 10);
+  t_asserteq(batch.results[1].prog.memory[2], 9);
+  t_asserteq(batch.results[1].prog.code[1].operand, 2);
+  t_asserteq(batch.results[2].error, EINVAL);
+  t_asserteq(batch.results[3].error, ENOENT);
+  t_asserteq(batch.results[4].error, 0);
+  t_asserteq(batch.results[4].prog.count, 0);
+  load_batch_free(&batch);
+
+  for (size_t i = 0; i < 5; i++) (void)unlink(paths[i]);
+  (void)rmdir(dir);
+}
+
+test(load_batch_default) {
+  _assert_loads(LOAD_DEFAULT);
+}
+
+test(load_batch_threads) {
+  _assert_loads(LOAD_NO_URING);
+}
+#endif
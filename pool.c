@@ -0,0 +1,276 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "vm.h"
+
+typedef struct {
+  pthread_mutex_t lock;
+  Task **tasks; // ring buffer, live entries are [top, bottom)
+  size_t top;
+  size_t bottom;
+  size_t capacity;
+} Deque;
+
+struct Pool {
+  size_t nworkers;
+  pthread_t *threads;
+  Deque *deques; // one per worker, plus one shared by outside threads
+  atomic_size_t pending;
+  atomic_bool stop;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle;
+  pthread_mutex_t free_lock;
+  Task *free;
+};
+
+static _Thread_local Pool *_pool_owner = NULL;
+static _Thread_local size_t _pool_self = 0;
+
+static void _deque_push(Deque *d, Task *task)
+{
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top == d->capacity) {
+    const size_t capacity = d->capacity ? d->capacity * 2 : 64;
+    Task **tasks = malloc(sizeof(Task *) * capacity);
+    if (tasks == NULL) exit(1);
+    for (size_t i = d->top; i != d->bottom; i++)
+      tasks[i % capacity] = d->tasks[i % d->capacity];
+    free(d->tasks);
+    d->tasks = tasks;
+    d->capacity = capacity;
+  }
+  d->tasks[d->bottom++ % d->capacity] = task;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static Task *_deque_pop(Deque *d)
+{
+  Task *task = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom != d->top) task = d->tasks[--d->bottom % d->capacity];
+  pthread_mutex_unlock(&d->lock);
+  return task;
+}
+
+static Task *_deque_steal(Deque *d)
+{
+  Task *task = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom != d->top) task = d->tasks[d->top++ % d->capacity];
+  pthread_mutex_unlock(&d->lock);
+  return task;
+}
+
+static inline Deque *_pool_own_deque(Pool *pool)
+{
+  return &pool->deques[_pool_owner == pool ? _pool_self : pool->nworkers];
+}
+
+// Takes the newest task from the calling thread's own deque, or else the
+// oldest one from any other deque.
+static Task *_pool_take(Pool *pool)
+{
+  Deque *own = _pool_own_deque(pool);
+  Task *task = _deque_pop(own);
+  const size_t ndeques = pool->nworkers + 1;
+  const size_t start = own - pool->deques;
+  for (size_t i = 1; task == NULL && i < ndeques; i++)
+    task = _deque_steal(&pool->deques[(start + i) % ndeques]);
+  if (task != NULL) atomic_fetch_sub(&pool->pending, 1);
+  return task;
+}
+
+static void _pool_run(Task *task)
+{
+  task->result = vm_run(&task->vm);
+  atomic_store_explicit(&task->done, true, memory_order_release);
+}
+
+static void *_pool_worker(void *arg)
+{
+  Pool *pool = arg;
+  for (;;) {
+    Task *task = _pool_take(pool);
+    if (task != NULL) {
+      _pool_run(task);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    while (atomic_load(&pool->pending) == 0 && !atomic_load(&pool->stop))
+      pthread_cond_wait(&pool->idle, &pool->idle_lock);
+    pthread_mutex_unlock(&pool->idle_lock);
+    if (atomic_load(&pool->stop)) return NULL;
+  }
+}
+
+typedef struct {
+  Pool *pool;
+  size_t self;
+} WorkerArgs;
+
+static void *_pool_worker_start(void *arg)
+{
+  WorkerArgs args = *(WorkerArgs *)arg;
+  free(arg);
+  _pool_owner = args.pool;
+  _pool_self = args.self;
+  return _pool_worker(args.pool);
+}
+
+Pool *pool_new(size_t nworkers)
+{
+  Pool *pool = calloc(1, sizeof(Pool));
+  if (pool == NULL) exit(1);
+  pool->nworkers = nworkers;
+  pool->threads = malloc(sizeof(pthread_t) * nworkers);
+  pool->deques = calloc(nworkers + 1, sizeof(Deque));
+  if (pool->threads == NULL || pool->deques == NULL) exit(1);
+  for (size_t i = 0; i <= nworkers; i++)
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+  pthread_mutex_init(&pool->idle_lock, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pthread_mutex_init(&pool->free_lock, NULL);
+
+  for (size_t i = 0; i < nworkers; i++) {
+    WorkerArgs *args = malloc(sizeof(WorkerArgs));
+    if (args == NULL) exit(1);
+    *args = (WorkerArgs){.pool = pool, .self = i};
+    if (pthread_create(&pool->threads[i], NULL, _pool_worker_start, args) != 0)
+      exit(1);
+  }
+  return pool;
+}
+
+void pool_free(Pool *pool)
+{
+  pthread_mutex_lock(&pool->idle_lock);
+  atomic_store(&pool->stop, true);
+  pthread_cond_broadcast(&pool->idle);
+  pthread_mutex_unlock(&pool->idle_lock);
+  for (size_t i = 0; i < pool->nworkers; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  for (size_t i = 0; i <= pool->nworkers; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+  while (pool->free != NULL) {
+    Task *next = pool->free->next;
+    free(pool->free);
+    pool->free = next;
+  }
+  pthread_mutex_destroy(&pool->idle_lock);
+  pthread_cond_destroy(&pool->idle);
+  pthread_mutex_destroy(&pool->free_lock);
+  free(pool->threads);
+  free(pool->deques);
+  free(pool);
+}
+
+// Recycled tasks keep their (large) VM, only the registers are reset. A
+// task is never put back while it still has children, so `children` is
+// already all NULL.
+static Task *_pool_task_acquire(Pool *pool)
+{
+  Task *task = NULL;
+  if (pool != NULL) {
+    pthread_mutex_lock(&pool->free_lock);
+    task = pool->free;
+    if (task != NULL) pool->free = task->next;
+    pthread_mutex_unlock(&pool->free_lock);
+  }
+  if (task == NULL) {
+    task = calloc(1, sizeof(Task));
+    if (task == NULL) exit(1);
+  }
+  return task;
+}
+
+static void _pool_task_release(Pool *pool, Task *task)
+{
+  pool_reap(pool, &task->vm);
+  if (pool == NULL) {
+    free(task);
+    return;
+  }
+  pthread_mutex_lock(&pool->free_lock);
+  task->next = pool->free;
+  pool->free = task;
+  pthread_mutex_unlock(&pool->free_lock);
+}
+
+Task *pool_spawn(const VM *parent, size_t ip, const Value *args, size_t argc)
+{
+  Pool *pool = parent->pool;
+  Task *task = _pool_task_acquire(pool);
+  VM *vm = &task->vm;
+  vm->code = parent->code;
+  vm->count = parent->count;
+  vm->ip = ip;
+  (void)memcpy(vm->stack, args, sizeof(Value) * argc);
+  vm->sp = argc;
+  vm->rsp = 0;
+  vm->memory = NULL;
+  vm->memory_size = 0;
+  vm->pool = pool;
+  vm->budget = parent->budget;
+  vm->fuel = 0;
+  vm->halted = false;
+  task->result = VM_ERR_NONE;
+  atomic_store(&task->done, false);
+
+  if (pool == NULL) {
+    _pool_run(task);
+    return task;
+  }
+
+  // Counted before it can be taken, so `pending` never drops below zero
+  // when a thief gets to the task first.
+  atomic_fetch_add(&pool->pending, 1);
+  _deque_push(_pool_own_deque(pool), task);
+  pthread_mutex_lock(&pool->idle_lock);
+  pthread_cond_signal(&pool->idle);
+  pthread_mutex_unlock(&pool->idle_lock);
+  return task;
+}
+
+static void _pool_wait(Pool *pool, Task *task)
+{
+  while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+    Task *other = pool ? _pool_take(pool) : NULL;
+    if (other != NULL) _pool_run(other);
+    else sched_yield();
+  }
+}
+
+vm_err_t pool_join(Pool *pool, Task *task, VM *into)
+{
+  _pool_wait(pool, task);
+  vm_err_t result = task->result;
+  if (result == VM_ERR_NONE && into->sp + task->vm.sp > VM_STACK_CAPACITY)
+    result = VM_ERR_STACK_OVERFLOW;
+  if (result == VM_ERR_NONE) {
+    (void)memcpy(into->stack + into->sp, task->vm.stack, sizeof(Value) * task->vm.sp);
+    into->sp += task->vm.sp;
+  }
+  _pool_task_release(pool, task);
+  return result;
+}
+
+void pool_reap(Pool *pool, VM *vm)
+{
+  for (size_t i = 0; i < VM_CHILDREN_CAPACITY; i++) {
+    if (vm->children[i] == NULL) continue;
+    _pool_wait(pool, vm->children[i]);
+    _pool_task_release(pool, vm->children[i]);
+    vm->children[i] = NULL;
+  }
+}
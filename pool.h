@@ -0,0 +1,90 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+// Runs the children created by `spawn` on a fixed set of worker threads.
+// Every worker owns a deque: it pushes and pops its own work at the
+// bottom, and idle workers steal from the top of the others. A thread
+// waiting in `join` keeps running queued children until its own is done,
+// so nested spawns cannot starve the pool.
+//
+// A child only sees its own copy of the arguments and the parent's
+// (immutable) code, so its results do not depend on scheduling.
+
+typedef struct Task {
+  VM vm;
+  vm_err_t result;
+  atomic_bool done;
+  struct Task *next; // free list
+} Task;
+
+typedef struct Pool Pool;
+
+Pool *pool_new(size_t nworkers);
+void pool_free(Pool *pool);
+
+// Starts a child of `parent` at `ip`, on the parent's pool and budget.
+// With a NULL pool the child runs to completion before `pool_spawn` returns.
+Task *pool_spawn(const VM *parent, size_t ip, const Value *args, size_t argc);
+// Waits for `task`, pushes its final stack onto `into` and recycles it.
+vm_err_t pool_join(Pool *pool, Task *task, VM *into);
+// Waits for and discards all children of `vm` that were never joined.
+void pool_reap(Pool *pool, VM *vm);
+
+#endif // _POOL_H
+
+#ifdef _TEST_IMPL
+#include "test.h"
+
+test(pool_spawn_inline) {
+  Inst code[] = {
+    inst_push(6), inst_push(7), inst_push(2), inst_spawn(4),
+    inst_join, inst_halt, inst_halt,
+    inst_mul, inst_push(1), inst_halt,
+  };
+  VM vm = {0};
+  vm.code = code;
+  vm.count = sizeof code / sizeof code[0];
+  t_asserteq(vm_run(&vm), VM_ERR_NONE);
+  t_asserteq(vm.sp, 2);
+  t_asserteq(vm.stack[0], 42);
+  t_asserteq(vm.stack[1], 1);
+}
+
+test(pool_join_is_deterministic) {
+  Inst code[] = {
+    inst_push(5), inst_push(1), inst_spawn(9),
+    inst_push(6), inst_push(1), inst_spawn(6),
+    inst_join, inst_dup(1), inst_join, inst_halt,
+    inst_halt,
+    inst_dup(0), inst_mul, inst_halt,
+  };
+  Pool *pool = pool_new(4);
+  for (int run = 0; run < 64; run++) {
+    VM vm = {0};
+    vm.code = code;
+    vm.count = sizeof code / sizeof code[0];
+    vm.pool = pool;
+    t_asserteq(vm_run(&vm), VM_ERR_NONE);
+    pool_reap(pool, &vm);
+    t_asserteq(vm.sp, 3);
+    t_asserteq(vm.stack[0], 0);
+    t_asserteq(vm.stack[1], 36);
+    t_asserteq(vm.stack[2], 25);
+  }
+  pool_free(pool);
+}
+
+test(pool_join_invalid_handle) {
+  Inst code[] = { inst_push(3), inst_join, inst_halt };
+  VM vm = {0};
+  vm.code = code;
+  vm.count = sizeof code / sizeof code[0];
+  t_asserteq(vm_run(&vm), VM_ERR_INVALID_HANDLE);
+}
+#endif
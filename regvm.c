@@ -0,0 +1,257 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "regvm.h"
+#include "verify.h"
+#include "vm.h"
+
+// What a stack slot currently holds: register `value`, or the constant
+// `value`. A slot is canonical when it holds its own register.
+typedef struct {
+  bool imm;
+  Value value;
+} Slot;
+
+typedef struct {
+  RInst *code;
+  size_t count;
+  size_t capacity;
+  Slot *slots;
+  size_t dirty; // every slot below this one is canonical
+} Translator;
+
+static void _emit(Translator *t, rop_t op, size_t dst, Value a, Value b)
+{
+  if (t->count == t->capacity) {
+    t->capacity = t->capacity ? t->capacity * 2 : 64;
+    t->code = realloc(t->code, sizeof(RInst) * t->capacity);
+    if (t->code == NULL) exit(1);
+  }
+  t->code[t->count++] = (RInst){.op = op, .dst = dst, .a = a, .b = b};
+}
+
+static void _reset(Translator *t, size_t depth)
+{
+  for (size_t s = 0; s < depth; s++) t->slots[s] = (Slot){.imm = false, .value = s};
+  t->dirty = depth;
+}
+
+static void _set(Translator *t, size_t slot, Slot value)
+{
+  t->slots[slot] = value;
+  if (slot < t->dirty) t->dirty = slot;
+}
+
+// Writes every slot below `depth` back to its own register. A slot only
+// ever refers to a lower, canonical register, so going upwards never
+// overwrites a register that is still to be read.
+static void _materialize(Translator *t, size_t depth)
+{
+  for (size_t s = t->dirty; s < depth; s++) {
+    const Slot slot = t->slots[s];
+    if (slot.imm) _emit(t, ROP_MOV_I, s, slot.value, 0);
+    else if ((size_t)slot.value != s) _emit(t, ROP_MOV_R, s, slot.value, 0);
+    t->slots[s] = (Slot){.imm = false, .value = s};
+  }
+  t->dirty = depth;
+}
+
+// Evaluates a binop on two constants the way the stack machine would, with
+// wrapping arithmetic. Division that would trap is left to runtime.
+static bool _fold(inst_t type, Value a, Value b, Value *out)
+{
+  if (type == INST_ADD) *out = (Value)((uint64_t)a + (uint64_t)b);
+  else if (type == INST_SUB) *out = (Value)((uint64_t)a - (uint64_t)b);
+  else if (type == INST_MUL) *out = (Value)((uint64_t)a * (uint64_t)b);
+  else if (type == INST_EQ) *out = a == b;
+  else if (b == 0 || (a == INT64_MIN && b == -1)) return false;
+  else *out = a / b;
+  return true;
+}
+
+static void _binop(Translator *t, inst_t type, size_t depth)
+{
+  const rop_t base = type == INST_ADD   ? ROP_ADD_RR
+                    : type == INST_SUB ? ROP_SUB_RR
+                    : type == INST_MUL ? ROP_MUL_RR
+                    : type == INST_DIV ? ROP_DIV_RR
+                                       : ROP_EQ_RR;
+
+  const size_t dst = depth - 2;
+  const Slot a = t->slots[depth - 1], b = t->slots[depth - 2];
+  Value folded;
+  if (a.imm && b.imm && _fold(type, a.value, b.value, &folded)) {
+    _set(t, dst, (Slot){.imm = true, .value = folded});
+    return;
+  }
+  if (a.imm && b.imm) {
+    _emit(t, ROP_MOV_I, dst, b.value, 0);
+    _emit(t, base + 2, dst, a.value, dst);
+  } else if (a.imm) {
+    _emit(t, base + 2, dst, a.value, b.value);
+  } else if (b.imm) {
+    _emit(t, base + 1, dst, a.value, b.value);
+  } else {
+    _emit(t, base, dst, a.value, b.value);
+  }
+  t->slots[dst] = (Slot){.imm = false, .value = dst};
+}
+
+bool rvm_translate(const Inst *code, size_t count, size_t entry,
+                   size_t initial_depth, RProg *out)
+{
+  *out = (RProg){0};
+  if (count == 0) return false;
+
+  size_t *depths = malloc(sizeof(size_t) * count);
+  size_t *labels = malloc(sizeof(size_t) * count);
+  bool *targets = calloc(count, sizeof(bool));
+  if (depths == NULL || labels == NULL || targets == NULL) exit(1);
+  Translator t = {0};
+
+  size_t max_depth;
+  if (!verify_prog(code, count, entry, initial_depth, depths, &max_depth))
+    goto FAIL;
+  targets[entry] = true;
+  for (size_t ip = 0; ip < count; ip++) {
+    if (depths[ip] == VERIFY_UNREACHABLE) continue;
+    const Inst inst = code[ip];
+    if (inst.type == INST_JMP || inst.type == INST_JZ || inst.type == INST_JNZ)
+      targets[ip + inst.operand] = true;
+  }
+
+  t.slots = malloc(sizeof(Slot) * (max_depth + 1));
+  if (t.slots == NULL) exit(1);
+
+  // Jumps carry the target `ip` in `dst` until every label is known.
+  bool live = false;
+  for (size_t ip = 0; ip < count; ip++) {
+    size_t depth = depths[ip];
+    if (depth == VERIFY_UNREACHABLE) {
+      live = false;
+      continue;
+    }
+    if (targets[ip]) {
+      if (live) _materialize(&t, depth);
+      labels[ip] = t.count;
+      _reset(&t, depth);
+    }
+    live = true;
+
+    const Inst inst = code[ip];
+    switch (inst.type) {
+    case INST_NOP: break;
+    case INST_PUSH: _set(&t, depth, (Slot){.imm = true, .value = inst.operand}); break;
+    case INST_DUP: _set(&t, depth, t.slots[depth - 1 - inst.operand]); break;
+
+    case INST_ADD:
+    case INST_SUB:
+    case INST_MUL:
+    case INST_DIV:
+    case INST_EQ: _binop(&t, inst.type, depth); break;
+
+    case INST_JMP: {
+      _materialize(&t, depth);
+      _emit(&t, ROP_JMP, ip + inst.operand, 0, 0);
+      live = false;
+    } break;
+
+    case INST_JZ:
+    case INST_JNZ: {
+      const Slot cond = t.slots[depth - 1];
+      _materialize(&t, depth - 1);
+      const rop_t op = inst.type == INST_JZ ? ROP_JZ : ROP_JNZ;
+      if (!cond.imm) _emit(&t, op, ip + inst.operand, cond.value, 0);
+      else if ((cond.value != 0) == (op == ROP_JNZ))
+        _emit(&t, ROP_JMP, ip + inst.operand, 0, 0);
+    } break;
+
+    case INST_HALT: {
+      _materialize(&t, depth);
+      _emit(&t, ROP_HALT, depth, ip + 1, 0);
+      live = false;
+    } break;
+
+    case INST_LOAD:
+    case INST_STORE:
+    case INST_MEMCPY:
+    case INST_MEMSET:
+    case INST_CALL:
+    case INST_RET:
+    case INST_SPAWN:
+    case INST_JOIN: goto FAIL;
+    default: goto FAIL;
+    }
+  }
+
+  for (size_t i = 0; i < t.count; i++) {
+    RInst *r = &t.code[i];
+    if (r->op == ROP_JMP || r->op == ROP_JZ || r->op == ROP_JNZ)
+      r->dst = labels[r->dst];
+  }
+
+  *out = (RProg){
+    .code = t.code,
+    .count = t.count,
+    .start = labels[entry],
+    .initial_depth = initial_depth,
+  };
+  free(t.slots);
+  free(depths);
+  free(labels);
+  free(targets);
+  return true;
+
+FAIL:
+  free(t.code);
+  free(t.slots);
+  free(depths);
+  free(labels);
+  free(targets);
+  return false;
+}
+
+void rvm_free(RProg *prog)
+{
+  free(prog->code);
+  *prog = (RProg){0};
+}
+
+#define __rbinop(name, operation)                                          \
+  case ROP_##name##_RR: r[i->dst] = r[i->a] operation r[i->b]; break;      \
+  case ROP_##name##_RI: r[i->dst] = r[i->a] operation i->b; break;         \
+  case ROP_##name##_IR: r[i->dst] = i->a operation r[i->b]; break
+
+vm_err_t rvm_run(const RProg *prog, VM *vm)
+{
+  if (vm->sp != prog->initial_depth) return VM_ERR_ILLEGAL_INST;
+  Value *r = vm->stack;
+  const RInst *code = prog->code;
+  size_t ip = prog->start;
+
+  for (;;) {
+    const RInst *i = &code[ip++];
+    switch ((rop_t)i->op) {
+    case ROP_MOV_R: r[i->dst] = r[i->a]; break;
+    case ROP_MOV_I: r[i->dst] = i->a; break;
+    __rbinop(ADD, +);
+    __rbinop(SUB, -);
+    __rbinop(MUL, *);
+    __rbinop(DIV, /);
+    __rbinop(EQ, ==);
+    case ROP_JMP: ip = i->dst; break;
+    case ROP_JZ: if (!r[i->a]) ip = i->dst; break;
+    case ROP_JNZ: if (r[i->a]) ip = i->dst; break;
+    case ROP_HALT: {
+      vm->sp = i->dst;
+      vm->ip = i->a;
+      vm->halted = true;
+    } return VM_ERR_NONE;
+    default: return VM_ERR_ILLEGAL_INST;
+    }
+  }
+}
+
+#undef __rbinop
@@ -0,0 +1,135 @@
+#ifndef _REGVM_H
+#define _REGVM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// Register form of a verified program. Stack slot `i` becomes register
+// `i`, and the register file is the VM's own stack, so a run leaves
+// exactly the stack `vm_run` would have left.
+//
+// `push` and `dup` emit nothing: the translator tracks which register or
+// constant each slot holds and only writes slots back to their own
+// registers (`mov`) where control flow merges. Arithmetic takes its
+// operands straight from registers or immediates, so most programs need
+// far fewer dispatches than on the stack machine.
+
+#define __ROP_BINOP(name) ROP_##name##_RR, ROP_##name##_RI, ROP_##name##_IR
+
+typedef enum {
+  ROP_MOV_R,
+  ROP_MOV_I,
+  __ROP_BINOP(ADD),
+  __ROP_BINOP(SUB),
+  __ROP_BINOP(MUL),
+  __ROP_BINOP(DIV),
+  __ROP_BINOP(EQ),
+  ROP_JMP,
+  ROP_JZ,
+  ROP_JNZ,
+  ROP_HALT,
+} rop_t;
+
+#undef __ROP_BINOP
+
+// `dst` is the destination register, the jump target for jumps, and the
+// final stack depth for `halt`. `a` and `b` hold registers or immediates
+// as given by the `_R`/`_I` suffixes; `a` is the left (stack top) operand.
+typedef struct {
+  uint32_t op;
+  uint32_t dst;
+  Value a;
+  Value b;
+} RInst;
+
+typedef struct {
+  RInst *code;
+  size_t count;
+  size_t start;
+  size_t initial_depth; // `vm->sp` the program was translated for
+} RProg;
+
+// Fails for programs that do not verify (see verify.h) or that use
+// instructions with side effects or runtime errors (memory, calls,
+// spawns); those have to run on `vm_run`.
+bool rvm_translate(const Inst *code, size_t count, size_t entry,
+                   size_t initial_depth, RProg *out);
+void rvm_free(RProg *prog);
+vm_err_t rvm_run(const RProg *prog, VM *vm);
+
+#endif // _REGVM_H
+
+#ifdef _TEST_IMPL
+#include "test.h"
+
+static void _assert_rvm_matches_vm(Inst *code, size_t count,
+                                   const Value *init, size_t initc)
+{
+  RProg prog;
+  t_assert(rvm_translate(code, count, 0, initc, &prog));
+
+  VM expected = {0}, got = {0};
+  expected.code = got.code = code;
+  expected.count = got.count = count;
+  for (size_t i = 0; i < initc; i++)
+    expected.stack[expected.sp++] = got.stack[got.sp++] = init[i];
+  t_asserteq(vm_run(&expected), VM_ERR_NONE);
+  t_asserteq(rvm_run(&prog, &got), VM_ERR_NONE);
+
+  t_asserteq(got.sp, expected.sp);
+  t_asserteq(got.ip, expected.ip);
+  t_assert(got.halted);
+  for (size_t i = 0; i < expected.sp; i++)
+    t_asserteq(got.stack[i], expected.stack[i]);
+  rvm_free(&prog);
+}
+
+test(rvm_folds_constants) {
+  Inst code[] = {
+    inst_push(2), inst_push(3), inst_mul, inst_push(1), inst_sub,
+    inst_dup(0), inst_dup(1), inst_halt,
+  };
+  RProg prog;
+  t_assert(rvm_translate(code, 8, 0, 0, &prog));
+  // Three `mov`s to write the constants back, then `halt`.
+  t_asserteq(prog.count, 4);
+  rvm_free(&prog);
+  _assert_rvm_matches_vm(code, 8, NULL, 0);
+}
+
+test(rvm_loop) {
+  Inst code[] = {
+    inst_dup(0),
+    inst_jz(8),
+    inst_dup(0),
+    inst_push(0),
+    inst_mul,
+    inst_add,
+    inst_push(-1),
+    inst_add,
+    inst_jmp(-8),
+    inst_halt,
+  };
+  Value n = 100;
+  _assert_rvm_matches_vm(code, 10, &n, 1);
+}
+
+test(rvm_division_by_immediates) {
+  Inst code[] = {
+    inst_dup(0), inst_push(84), inst_div,
+    inst_push(7), inst_push(0), inst_div,
+    inst_push(2), inst_eq, inst_halt,
+  };
+  Value init[] = { 2, 3 };
+  _assert_rvm_matches_vm(code, 9, init, 2);
+}
+
+test(rvm_rejects_unverifiable) {
+  Inst code[] = { inst_call(2), inst_halt, inst_ret };
+  RProg prog;
+  t_assert(!rvm_translate(code, 3, 0, 0, &prog));
+}
+#endif
@@ -0,0 +1,281 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spmd.h"
+#include "vm.h"
+
+void spmd_init(SPMD *s, Inst *code, size_t count, size_t lanes)
+{
+  *s = (SPMD){
+    .code = code,
+    .count = count,
+    .lanes = lanes,
+    .stack = malloc(sizeof(Value) * VM_STACK_CAPACITY * lanes),
+    .sp = calloc(lanes, sizeof(size_t)),
+    .error = calloc(lanes, sizeof(vm_err_t)),
+    .groups = calloc(lanes, sizeof(SPMDGroup)),
+  };
+  if (s->stack == NULL || s->sp == NULL || s->error == NULL || s->groups == NULL)
+    exit(1);
+}
+
+void spmd_free(SPMD *s)
+{
+  free(s->stack);
+  free(s->sp);
+  free(s->error);
+  for (size_t g = 0; g < s->ngroups; g++) free(s->groups[g].members);
+  free(s->groups);
+  *s = (SPMD){0};
+}
+
+vm_err_t spmd_push(SPMD *s, size_t lane, Value value)
+{
+  if (s->sp[lane] >= VM_STACK_CAPACITY) return VM_ERR_STACK_OVERFLOW;
+  spmd_slot(s, lane, s->sp[lane]++) = value;
+  return VM_ERR_NONE;
+}
+
+void spmd_lane_to_vm(const SPMD *s, size_t lane, VM *out)
+{
+  out->code = s->code;
+  out->count = s->count;
+  out->sp = s->sp[lane];
+  out->halted = s->error[lane] == VM_ERR_NONE;
+  for (size_t i = 0; i < out->sp; i++)
+    out->stack[i] = spmd_slot(s, lane, i);
+}
+
+static void _spmd_group_reserve(SPMDGroup *grp, size_t count)
+{
+  if (count <= grp->capacity) return;
+  size_t capacity = grp->capacity ? grp->capacity : 16;
+  while (capacity < count) capacity *= 2;
+  grp->members = realloc(grp->members, sizeof(size_t) * capacity);
+  if (grp->members == NULL) exit(1);
+  grp->capacity = capacity;
+}
+
+static size_t _spmd_group_new(SPMD *s, size_t ip, size_t sp)
+{
+  // Every live group owns at least one lane, so there is always room for
+  // another when a group is split.
+  const size_t g = s->ngroups++;
+  s->groups[g] = (SPMDGroup){.ip = ip, .sp = sp};
+  return g;
+}
+
+// Frees group `g` and moves the last group into its place.
+static void _spmd_group_remove(SPMD *s, size_t g)
+{
+  free(s->groups[g].members);
+  SPMDGroup *last = &s->groups[--s->ngroups];
+  if (g == s->ngroups) return;
+  SPMDGroup *grp = &s->groups[g];
+  (void)memcpy(grp, last, offsetof(SPMDGroup, rstack));
+  (void)memcpy(grp->rstack, last->rstack, sizeof(size_t) * last->rsp);
+}
+
+static bool _spmd_group_same_state(const SPMDGroup *a, const SPMDGroup *b)
+{
+  return a->ip == b->ip && a->sp == b->sp && a->rsp == b->rsp &&
+         memcmp(a->rstack, b->rstack, sizeof(size_t) * a->rsp) == 0;
+}
+
+static void _spmd_group_retire(SPMD *s, size_t g, vm_err_t error)
+{
+  const SPMDGroup *grp = &s->groups[g];
+  for (size_t i = 0; i < grp->count; i++) {
+    s->sp[grp->members[i]] = grp->sp;
+    s->error[grp->members[i]] = error;
+  }
+  _spmd_group_remove(s, g);
+}
+
+static void _spmd_group_merge(SPMD *s, size_t into, size_t from)
+{
+  SPMDGroup *a = &s->groups[into];
+  const SPMDGroup *b = &s->groups[from];
+  _spmd_group_reserve(a, a->count + b->count);
+  (void)memcpy(a->members + a->count, b->members, sizeof(size_t) * b->count);
+  a->count += b->count;
+  _spmd_group_remove(s, from);
+}
+
+// Loops over one column for the lanes of the group: straight down the
+// column when it holds every lane, through its lane list otherwise.
+#define __lanes(expr)                                     \
+  do {                                                    \
+    if (grp->count == s->lanes) {                         \
+      for (size_t l = 0; l < s->lanes; l++) expr;         \
+    } else {                                              \
+      for (size_t i_ = 0; i_ < grp->count; i_++) {        \
+        const size_t l = grp->members[i_];                \
+        expr;                                             \
+      }                                                   \
+    }                                                     \
+  } while (0)
+
+#define __binop(operation)                                              \
+  do {                                                                  \
+    if (grp->sp < 2) return VM_ERR_STACK_UNDERFLOW;                     \
+    const Value *a = s->stack + (grp->sp - 1) * s->lanes;               \
+    Value *b = s->stack + (grp->sp - 2) * s->lanes;                     \
+    __lanes(b[l] = a[l] operation b[l]);                                \
+    grp->sp--;                                                          \
+  } while (0)
+
+// Executes the instruction at the group's ip for all of its lanes. A
+// diverging branch moves the lanes that take it into a new group.
+static vm_err_t _spmd_exec(SPMD *s, size_t g, bool *halted)
+{
+  SPMDGroup *grp = &s->groups[g];
+  if (grp->ip >= s->count) return VM_ERR_IP_OUT_OF_BOUNDS;
+  const Inst inst = s->code[grp->ip];
+
+  switch (inst.type) {
+  case INST_NOP: break;
+
+  case INST_PUSH: {
+    if (grp->sp >= VM_STACK_CAPACITY) return VM_ERR_STACK_OVERFLOW;
+    Value *top = s->stack + grp->sp * s->lanes;
+    __lanes(top[l] = inst.operand);
+    grp->sp++;
+  } break;
+
+  case INST_DUP: {
+    if ((size_t)inst.operand >= grp->sp) return VM_ERR_STACK_UNDERFLOW;
+    if (grp->sp >= VM_STACK_CAPACITY) return VM_ERR_STACK_OVERFLOW;
+    Value *top = s->stack + grp->sp * s->lanes;
+    const Value *src = s->stack + (grp->sp - 1 - inst.operand) * s->lanes;
+    __lanes(top[l] = src[l]);
+    grp->sp++;
+  } break;
+
+  case INST_ADD: __binop(+); break;
+  case INST_SUB: __binop(-); break;
+  case INST_MUL: __binop(*); break;
+  case INST_DIV: __binop(/); break;
+  case INST_EQ: __binop(==); break;
+
+  case INST_JMP: {
+    grp->ip += inst.operand;
+  } return VM_ERR_NONE;
+
+  case INST_JZ:
+  case INST_JNZ: {
+    if (grp->sp == 0) return VM_ERR_STACK_UNDERFLOW;
+    const Value *cond = s->stack + --grp->sp * s->lanes;
+    const bool jump_if = inst.type == INST_JNZ;
+    size_t taken = 0;
+    __lanes(taken += (bool)cond[l] == jump_if);
+
+    if (taken == grp->count) {
+      grp->ip += inst.operand;
+      return VM_ERR_NONE;
+    }
+    if (taken != 0) {
+      // The lanes that jump move to a new group; the rest keep their
+      // order in this one.
+      const size_t h = _spmd_group_new(s, grp->ip + inst.operand, grp->sp);
+      SPMDGroup *jumped = &s->groups[h];
+      _spmd_group_reserve(jumped, taken);
+      jumped->rsp = grp->rsp;
+      (void)memcpy(jumped->rstack, grp->rstack, sizeof(size_t) * grp->rsp);
+      size_t kept = 0;
+      for (size_t i = 0; i < grp->count; i++) {
+        const size_t l = grp->members[i];
+        if ((bool)cond[l] == jump_if) jumped->members[jumped->count++] = l;
+        else grp->members[kept++] = l;
+      }
+      grp->count = kept;
+      // Keeps all lists together within a few times `lanes` entries.
+      if (kept * 4 < grp->capacity && grp->capacity > 16) {
+        grp->capacity = kept * 2 > 16 ? kept * 2 : 16;
+        grp->members = realloc(grp->members, sizeof(size_t) * grp->capacity);
+        if (grp->members == NULL) exit(1);
+      }
+    }
+  } break;
+
+  // Lanes have no linear memory of their own.
+  case INST_LOAD:
+  case INST_STORE:
+  case INST_MEMCPY:
+  case INST_MEMSET: return VM_ERR_ILLEGAL_INST;
+
+  case INST_CALL: {
+    if (grp->rsp >= VM_RSTACK_CAPACITY) return VM_ERR_RSTACK_OVERFLOW;
+    grp->rstack[grp->rsp++] = grp->ip + 1;
+    grp->ip += inst.operand;
+  } return VM_ERR_NONE;
+
+  case INST_RET: {
+    if (grp->rsp == 0) return VM_ERR_RSTACK_UNDERFLOW;
+    grp->ip = grp->rstack[--grp->rsp];
+  } return VM_ERR_NONE;
+
+  // Nor can they spawn children.
+  case INST_SPAWN:
+  case INST_JOIN: return VM_ERR_ILLEGAL_INST;
+
+  case INST_HALT: {
+    *halted = true;
+  } break;
+
+  default: return VM_ERR_ILLEGAL_INST;
+  }
+  grp->ip++;
+  return VM_ERR_NONE;
+}
+
+#undef __binop
+#undef __lanes
+
+void spmd_run(SPMD *s)
+{
+  // Start with one group per distinct starting depth.
+  for (size_t lane = 0; lane < s->lanes; lane++) {
+    size_t g = 0;
+    while (g < s->ngroups && s->groups[g].sp != s->sp[lane]) g++;
+    if (g == s->ngroups) g = _spmd_group_new(s, s->entry, s->sp[lane]);
+    SPMDGroup *grp = &s->groups[g];
+    _spmd_group_reserve(grp, grp->count + 1);
+    grp->members[grp->count++] = lane;
+    s->error[lane] = VM_ERR_NONE;
+  }
+
+  while (s->ngroups != 0) {
+    // Always advance the group that is furthest behind; a group that has
+    // branched ahead waits there for the others to catch up with it.
+    size_t g = 0;
+    for (size_t i = 1; i < s->ngroups; i++)
+      if (s->groups[i].ip < s->groups[g].ip) g = i;
+
+    size_t limit = SIZE_MAX;
+    for (size_t i = 0; i < s->ngroups;) {
+      if (i != g && _spmd_group_same_state(&s->groups[i], &s->groups[g])) {
+        _spmd_group_merge(s, g, i);
+        // The last group took the place of the one merged away.
+        if (g == s->ngroups) g = i;
+        continue;
+      }
+      if (i != g && s->groups[i].ip < limit) limit = s->groups[i].ip;
+      i++;
+    }
+
+    const size_t live = s->ngroups;
+    do {
+      bool halted = false;
+      vm_err_t result = _spmd_exec(s, g, &halted);
+      if (result != VM_ERR_NONE || halted) {
+        _spmd_group_retire(s, g, result);
+        break;
+      }
+      if (s->ngroups != live) break;
+    } while (s->groups[g].ip < limit);
+  }
+}
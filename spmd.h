@@ -0,0 +1,149 @@
+#ifndef _SPMD_H
+#define _SPMD_H
+
+#include <stddef.h>
+
+#include "vm.h"
+
+// Runs one program over many independent starting stacks ("lanes") in
+// lockstep. The stacks are stored slot-major, so slot `i` of every lane
+// is a contiguous column and a single instruction becomes a loop over
+// that column.
+//
+// Lanes that share an instruction pointer, stack depth and return stack
+// form a group, which keeps the list of its lanes so an instruction only
+// touches those. A `jz`/`jnz` whose condition differs between the lanes
+// of a group splits it in two, and groups that arrive at the same state
+// are merged again.
+
+typedef struct {
+  size_t ip;
+  size_t sp;
+  size_t count;
+  size_t *members;    // the group's `count` lanes
+  size_t capacity;
+  size_t rsp;
+  size_t rstack[VM_RSTACK_CAPACITY];
+} SPMDGroup;
+
+typedef struct {
+  Inst *code;
+  size_t count;
+  size_t entry;
+  size_t lanes;
+  Value *stack;       // [VM_STACK_CAPACITY][lanes]
+  size_t *sp;         // per lane
+  vm_err_t *error;    // per lane
+  SPMDGroup *groups;  // the `ngroups` live ones come first, at most `lanes`
+  size_t ngroups;
+} SPMD;
+
+#define spmd_slot(s, lane, slot) ((s)->stack[(slot) * (s)->lanes + (lane)])
+
+void spmd_init(SPMD *s, Inst *code, size_t count, size_t lanes);
+void spmd_free(SPMD *s);
+vm_err_t spmd_push(SPMD *s, size_t lane, Value value);
+void spmd_run(SPMD *s);
+void spmd_lane_to_vm(const SPMD *s, size_t lane, VM *out);
+
+#endif // _SPMD_H
+
+#ifdef _TEST_IMPL
+#include "test.h"
+
+static void _spmd_seed(Value *stack, size_t *sp, size_t lane)
+{
+  stack[(*sp)++] = (Value)lane;
+  if (lane % 3 == 0) stack[(*sp)++] = (Value)(lane % 4);
+}
+
+static void _assert_spmd_matches_vm(Inst *code, size_t count, size_t lanes)
+{
+  SPMD s;
+  spmd_init(&s, code, count, lanes);
+  for (size_t lane = 0; lane < lanes; lane++) {
+    Value seed[2];
+    size_t count = 0;
+    _spmd_seed(seed, &count, lane);
+    for (size_t i = 0; i < count; i++) spmd_push(&s, lane, seed[i]);
+  }
+  spmd_run(&s);
+
+  for (size_t lane = 0; lane < lanes; lane++) {
+    VM vm = {0};
+    vm.code = code;
+    vm.count = count;
+    _spmd_seed(vm.stack, &vm.sp, lane);
+    vm_err_t expected = vm_run(&vm);
+
+    VM got = {0};
+    spmd_lane_to_vm(&s, lane, &got);
+    t_asserteq(s.error[lane], expected);
+    t_asserteq(got.sp, vm.sp);
+    for (size_t i = 0; i < vm.sp; i++)
+      t_asserteq(got.stack[i], vm.stack[i]);
+  }
+  spmd_free(&s);
+}
+
+test(spmd_straight_line) {
+  Inst code[] = {
+    inst_push(3), inst_mul, inst_dup(0), inst_add, inst_push(1),
+    inst_sub, inst_halt,
+  };
+  _assert_spmd_matches_vm(code, sizeof code / sizeof code[0], 37);
+}
+
+test(spmd_divergent_branches) {
+  // Both paths leave the stack at the same depth and meet again at `halt`.
+  Inst code[] = {
+    inst_dup(0),
+    inst_jz(4),
+    inst_push(100),
+    inst_mul,
+    inst_jmp(3),
+    inst_push(-100),
+    inst_add,
+    inst_halt,
+  };
+  _assert_spmd_matches_vm(code, sizeof code / sizeof code[0], 40);
+}
+
+test(spmd_divergent_loop) {
+  // Counts the top of every lane down to zero, so each lane leaves the
+  // loop after a different number of iterations.
+  Inst code[] = {
+    inst_dup(0),
+    inst_jz(4),
+    inst_push(-1),
+    inst_add,
+    inst_jmp(-4),
+    inst_halt,
+  };
+  _assert_spmd_matches_vm(code, sizeof code / sizeof code[0], 64);
+}
+
+test(spmd_calls) {
+  // The callee branches on the lane's value, so lanes split inside it and
+  // only rejoin once they have returned to the same call site.
+  Inst code[] = {
+    inst_call(4),
+    inst_call(3),
+    inst_halt,
+    inst_nop,
+    inst_dup(0),
+    inst_jnz(3),
+    inst_push(5),
+    inst_add,
+    inst_push(2),
+    inst_mul,
+    inst_ret,
+  };
+  _assert_spmd_matches_vm(code, sizeof code / sizeof code[0], 24);
+}
+
+test(spmd_underflow_is_per_lane) {
+  Inst code[] = { inst_add, inst_add, inst_halt };
+  _assert_spmd_matches_vm(code, sizeof code / sizeof code[0], 9);
+}
+#endif
@@ -0,0 +1,197 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "pool.h"
+#include "vm.h"
+
+// Resident server that keeps loaded programs and ready VMs around between
+// requests. See daemon.h for the protocol; requests are handled in
+// daemon.c, this file only moves them to and from sockets.
+
+typedef struct {
+  int fd;
+  size_t out_done; // bytes of `io.out` already written
+  DaemonConn io;
+} Conn;
+
+typedef struct {
+  DaemonWorker *run;
+  Conn *conns;
+  size_t nconns;
+  size_t conns_cap;
+  struct pollfd *fds;
+} Worker;
+
+static int listener = -1;
+
+// Writes as much of the queued responses as the socket takes right now.
+static bool flush(Conn *c)
+{
+  DaemonConn *io = &c->io;
+  while (c->out_done < io->out_len) {
+    ssize_t n = write(c->fd, io->out + c->out_done, io->out_len - c->out_done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (n <= 0) return false;
+    c->out_done += n;
+  }
+  io->out_len = c->out_done = 0;
+  return true;
+}
+
+// Reads what has arrived and answers it. Requests are only taken on once
+// the previous responses are out, so a client that does not read cannot
+// make the daemon queue without end. Returns false once the connection
+// is done with.
+static bool step(Worker *w, Conn *c, short revents)
+{
+  DaemonConn *io = &c->io;
+  if (revents & (POLLIN | POLLHUP | POLLERR)) {
+    daemon_conn_reserve(io);
+    ssize_t n = read(c->fd, io->in + io->in_len, io->in_cap - io->in_len);
+    if (n == 0) io->closing = true;
+    else if (n > 0) io->in_len += n;
+    else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) return false;
+  }
+  if (io->out_len == 0) daemon_handle_all(w->run, io);
+  if (!flush(c)) return false;
+  return !io->closing || io->out_len != 0;
+}
+
+static void _conn_close(Worker *w, size_t i)
+{
+  Conn *c = &w->conns[i];
+  (void)close(c->fd);
+  daemon_conn_free(&c->io);
+  *c = w->conns[--w->nconns];
+}
+
+static void _accept_all(Worker *w)
+{
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      // Another worker may have taken it first.
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      perror("accept");
+      exit(1);
+    }
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+      (void)close(fd);
+      continue;
+    }
+    if (w->nconns == w->conns_cap) {
+      w->conns_cap = w->conns_cap ? w->conns_cap * 2 : 64;
+      w->conns = realloc(w->conns, sizeof(Conn) * w->conns_cap);
+      w->fds = realloc(w->fds, sizeof(struct pollfd) * (w->conns_cap + 1));
+      if (w->conns == NULL || w->fds == NULL) exit(1);
+    }
+    Conn *c = &w->conns[w->nconns++];
+    *c = (Conn){.fd = fd};
+    daemon_conn_init(&c->io);
+  }
+}
+
+// Every worker waits on the listener and on the connections it accepted,
+// none of which ties it up while idle.
+static void *worker_main(void *arg)
+{
+  (void)arg;
+  Worker *w = calloc(1, sizeof(Worker));
+  if (w == NULL) exit(1);
+  w->run = daemon_worker_new();
+  w->fds = malloc(sizeof(struct pollfd));
+  if (w->fds == NULL) exit(1);
+
+  for (;;) {
+    w->fds[0] = (struct pollfd){.fd = listener, .events = POLLIN};
+    for (size_t i = 0; i < w->nconns; i++) {
+      const Conn *c = &w->conns[i];
+      w->fds[i + 1] = (struct pollfd){.fd = c->fd, .events = c->io.out_len ? POLLOUT : POLLIN};
+    }
+    const size_t nconns = w->nconns;
+    if (poll(w->fds, nconns + 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      exit(1);
+    }
+    // Backwards, as closing one moves the last connection into its place.
+    for (size_t i = nconns; i-- > 0;)
+      if (w->fds[i + 1].revents != 0 && !step(w, &w->conns[i], w->fds[i + 1].revents))
+        _conn_close(w, i);
+    if (w->fds[0].revents & POLLIN) _accept_all(w);
+  }
+}
+
+int main(int argc, const char *argv[])
+{
+  size_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t pool_threads = 0;
+  DaemonConfig config = {
+    .max_steps = (uint64_t)1 << 28,
+    .cache_limit = (size_t)256 << 20,
+    .max_memory = ((size_t)16 << 20) / sizeof(Value),
+  };
+  const char *socket_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threads = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) pool_threads = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) config.bundle_path = argv[++i];
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) config.max_steps = strtoull(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) config.cache_limit = strtoull(argv[++i], NULL, 10) << 20;
+    else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+      config.max_memory = (strtoull(argv[++i], NULL, 10) << 20) / sizeof(Value);
+    else if (socket_path == NULL) socket_path = argv[i];
+    else { socket_path = NULL; break; }
+  }
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (socket_path == NULL || strlen(socket_path) >= sizeof addr.sun_path) {
+    fprintf(stderr,
+            "Error: expected a socket path\n"
+            "usage: %s [-t <threads>] [-j <pool threads>] [-b <bundle>]\n"
+            "          [-s <instructions per request>] [-c <cache MiB>]\n"
+            "          [-m <linear memory MiB per program>] <socket>\n",
+            argv[0]);
+    return 1;
+  }
+  (void)strcpy(addr.sun_path, socket_path);
+  if (threads == 0) threads = 1;
+
+  (void)signal(SIGPIPE, SIG_IGN);
+  if (pool_threads != 0) config.pool = pool_new(pool_threads);
+  daemon_init(&config);
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  (void)unlink(socket_path);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+      listen(listener, SOMAXCONN) != 0 ||
+      fcntl(listener, F_SETFL, O_NONBLOCK) != 0) {
+    fprintf(stderr, "Error: (operation on %s) could not listen: %s\n",
+            socket_path, strerror(errno));
+    return 1;
+  }
+
+  pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+  if (workers == NULL) exit(1);
+  for (size_t i = 0; i < threads; i++)
+    if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0) exit(1);
+  for (size_t i = 0; i < threads; i++)
+    pthread_join(workers[i], NULL);
+  return 0;
+}
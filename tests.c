@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE
 #define _TEST_IMPL
 #include "test.h"
 
@@ -5,6 +6,17 @@
 
 #define _LEXER_IMPL
 #include "lexer.h"
+#include "disk.h"
+#include "spmd.h"
+#include "pool.h"
+#include "verify.h"
+#include "regvm.h"
+#include "chunk.h"
+#include "loader.h"
+#include "channel.h"
+#include "inliner.h"
+#include "bundle.h"
+#include "daemon.h"
 
 int main(void) {
   for (size_t i = 0; i < _test_num_testcases; i++) {
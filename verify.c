@@ -0,0 +1,95 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "verify.h"
+#include "vm.h"
+
+// Number of values an instruction needs on the stack and the net change
+// it makes to the depth. Returns false for instructions whose effect is
+// not static.
+static bool _stack_effect(Inst inst, size_t *needs, long *delta)
+{
+  switch (inst.type) {
+  case INST_NOP:
+  case INST_JMP:
+  case INST_HALT: *needs = 0; *delta = 0; return true;
+  case INST_PUSH: *needs = 0; *delta = 1; return true;
+  case INST_DUP:
+    if (inst.operand < 0) return false;
+    *needs = inst.operand + 1; *delta = 1; return true;
+  case INST_ADD:
+  case INST_SUB:
+  case INST_MUL:
+  case INST_DIV:
+  case INST_EQ: *needs = 2; *delta = -1; return true;
+  case INST_JZ:
+  case INST_JNZ: *needs = 1; *delta = -1; return true;
+  case INST_LOAD: *needs = 1; *delta = 0; return true;
+  case INST_STORE: *needs = 2; *delta = -2; return true;
+  case INST_MEMCPY:
+  case INST_MEMSET: *needs = 3; *delta = -3; return true;
+  case INST_CALL:
+  case INST_RET:
+  case INST_SPAWN:
+  case INST_JOIN: return false;
+  default: return false;
+  }
+}
+
+#define _VERIFY_VISIT(target, depth)                          \
+  do {                                                        \
+    const Value t_ = (target);                                \
+    if (t_ < 0 || (size_t)t_ >= count) goto FAIL;             \
+    if (depths[t_] == VERIFY_UNREACHABLE) {                   \
+      depths[t_] = (depth);                                   \
+      pending[npending++] = t_;                               \
+    } else if (depths[t_] != (depth)) goto FAIL;              \
+  } while (0)
+
+bool verify_prog(const Inst *code, size_t count, size_t entry,
+                 size_t initial_depth, size_t *depths, size_t *max_depth)
+{
+  if (entry >= count || initial_depth > VM_STACK_CAPACITY) return false;
+  for (size_t i = 0; i < count; i++) depths[i] = VERIFY_UNREACHABLE;
+
+  // Every instruction is queued at most once, when it is first reached.
+  size_t *pending = malloc(sizeof(size_t) * count);
+  if (pending == NULL) exit(1);
+  size_t npending = 0;
+  size_t max = initial_depth;
+  _VERIFY_VISIT(entry, initial_depth);
+
+  while (npending != 0) {
+    const size_t ip = pending[--npending];
+    const Inst inst = code[ip];
+    const size_t depth = depths[ip];
+
+    size_t needs;
+    long delta;
+    if (!_stack_effect(inst, &needs, &delta)) goto FAIL;
+    if (depth < needs) goto FAIL;
+    if (delta > 0 && depth + delta > VM_STACK_CAPACITY) goto FAIL;
+    const size_t next = depth + delta;
+    if (next > max) max = next;
+
+    if (inst.type == INST_HALT) continue;
+    if (inst.type == INST_JMP) {
+      _VERIFY_VISIT((Value)ip + inst.operand, next);
+      continue;
+    }
+    if (inst.type == INST_JZ || inst.type == INST_JNZ)
+      _VERIFY_VISIT((Value)ip + inst.operand, next);
+    _VERIFY_VISIT((Value)ip + 1, next);
+  }
+
+  free(pending);
+  *max_depth = max;
+  return true;
+
+FAIL:
+  free(pending);
+  return false;
+}
+
+#undef _VERIFY_VISIT
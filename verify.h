@@ -0,0 +1,56 @@
+#ifndef _VERIFY_H
+#define _VERIFY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+#define VERIFY_UNREACHABLE ((size_t)-1)
+
+// Follows every path from `entry` and records the stack depth on entry to
+// each instruction in `depths` (VERIFY_UNREACHABLE if no path reaches it).
+// Succeeds only if that depth is the same on every path, no instruction
+// can underflow or overflow the stack, every branch stays inside the code
+// and no path runs off its end.
+//
+// `call`/`ret` and `spawn`/`join` have stack effects that are only known
+// at runtime, so programs using them never verify.
+bool verify_prog(const Inst *code, size_t count, size_t entry,
+                 size_t initial_depth, size_t *depths, size_t *max_depth);
+
+#endif // _VERIFY_H
+
+#ifdef _TEST_IMPL
+#include "test.h"
+
+test(verify_loop) {
+  Inst code[] = {
+    inst_push(10),
+    inst_dup(0),
+    inst_jz(4),
+    inst_push(-1),
+    inst_add,
+    inst_jmp(-4),
+    inst_halt,
+  };
+  size_t depths[7], max_depth;
+  t_assert(verify_prog(code, 7, 0, 0, depths, &max_depth));
+  t_asserteq(max_depth, 2);
+  t_asserteq(depths[2], 2);
+  t_asserteq(depths[6], 1);
+}
+
+test(verify_rejects_unbalanced_loop) {
+  Inst code[] = { inst_push(1), inst_jmp(-1), inst_halt };
+  size_t depths[3], max_depth;
+  t_assert(!verify_prog(code, 3, 0, 0, depths, &max_depth));
+}
+
+test(verify_rejects_underflow) {
+  Inst code[] = { inst_push(1), inst_add, inst_halt };
+  size_t depths[3], max_depth;
+  t_assert(!verify_prog(code, 3, 0, 0, depths, &max_depth));
+  t_assert(verify_prog(code, 3, 0, 1, depths, &max_depth));
+}
+#endif
@@ -1,15 +1,21 @@
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "vm.h"
+#include "pool.h"
 
-const bool VM_INST_HAS_OP[255] = {
+const bool VM_INST_HAS_OP[256] = {
   [INST_PUSH] = true,
+  [INST_DUP] = true,
   [INST_JMP] = true,
   [INST_JZ] = true,
   [INST_JNZ] = true,
+  [INST_CALL] = true,
+  [INST_SPAWN] = true,
 };
 
 const char* vm_err_to_cstr(vm_err_t error)
@@ -19,6 +25,13 @@ const char* vm_err_to_cstr(vm_err_t error)
   case VM_ERR_STACK_UNDERFLOW: return "stack underflow";
   case VM_ERR_STACK_OVERFLOW: return "stack overflow";
   case VM_ERR_ILLEGAL_INST: return "encountered illegal instruction";
+  case VM_ERR_MEMORY_OUT_OF_BOUNDS: return "memory access out of bounds";
+  case VM_ERR_RSTACK_UNDERFLOW: return "return stack underflow";
+  case VM_ERR_RSTACK_OVERFLOW: return "return stack overflow";
+  case VM_ERR_TOO_MANY_CHILDREN: return "too many children spawned";
+  case VM_ERR_INVALID_HANDLE: return "join on an invalid handle";
+  case VM_ERR_IP_OUT_OF_BOUNDS: return "ran outside of the code";
+  case VM_ERR_BUDGET_EXHAUSTED: return "instruction budget exhausted";
   }
 }
 
@@ -29,12 +42,58 @@ const char* vm_err_to_cstr(vm_err_t error)
     vm->sp--;                                                                      \
   } while (0)
 
+// True if the `count` cells starting at `addr` all lie inside linear memory.
+static inline bool _vm_mem_in_bounds(const VM *vm, Value addr, Value count)
+{
+  return (uint64_t)count <= vm->memory_size &&
+         (uint64_t)addr <= vm->memory_size - (uint64_t)count;
+}
+
+static const char _DIGIT_PAIRS[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+// Writes `value` in decimal so that it ends just before `end`, two digits
+// at a time, and returns where it starts.
+static char *_format_value(char *end, Value value)
+{
+  uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+  while (magnitude >= 100) {
+    end -= 2;
+    (void)memcpy(end, _DIGIT_PAIRS + magnitude % 100 * 2, 2);
+    magnitude /= 100;
+  }
+  if (magnitude >= 10) {
+    end -= 2;
+    (void)memcpy(end, _DIGIT_PAIRS + magnitude * 2, 2);
+  } else {
+    *--end = '0' + magnitude;
+  }
+  if (value < 0) *--end = '-';
+  return end;
+}
+
+// Formats the whole dump into one buffer and hands it to stdio in a
+// single write instead of one `printf` per value.
 void dump_stack(VM *vm)
 {
-  printf("STACK DUMP:\n");
+  static const char title[] = "STACK DUMP:\n";
+  // "  ", at most 20 characters of value, "\n"
+  char buffer[sizeof title + VM_STACK_CAPACITY * 23];
+  (void)memcpy(buffer, title, sizeof title - 1);
+  size_t n = sizeof title - 1;
   for (size_t i = 0; i < vm->sp; i++) {
-    printf("  %lld\n", vm->stack[i]);
+    char digits[20];
+    const char *start = _format_value(digits + sizeof digits, vm->stack[i]);
+    const size_t length = digits + sizeof digits - start;
+    buffer[n++] = ' ';
+    buffer[n++] = ' ';
+    (void)memcpy(buffer + n, start, length);
+    n += length;
+    buffer[n++] = '\n';
   }
+  (void)fwrite(buffer, 1, n, stdout);
 }
 
 vm_err_t vm_exec(VM *vm, Inst inst)
@@ -49,7 +108,7 @@ vm_err_t vm_exec(VM *vm, Inst inst)
   } break;
 
   case INST_DUP: {
-    if (vm->sp - inst.operand <= 0) return VM_ERR_STACK_UNDERFLOW;
+    if ((size_t)inst.operand >= vm->sp) return VM_ERR_STACK_UNDERFLOW;
     if (vm->sp >= VM_STACK_CAPACITY) return VM_ERR_STACK_OVERFLOW;
     vm->stack[vm->sp] = vm->stack[vm->sp - 1 - inst.operand];
     vm->sp++;
@@ -67,18 +126,90 @@ vm_err_t vm_exec(VM *vm, Inst inst)
 
   case INST_JZ: {
     if (vm->sp == 0) return VM_ERR_STACK_UNDERFLOW;
-    if ((bool)vm->stack[vm->sp--]) break;
+    if ((bool)vm->stack[--vm->sp]) break;
     vm->ip += inst.operand;
     return VM_ERR_NONE;
   };
 
   case INST_JNZ: {
     if (vm->sp == 0) return VM_ERR_STACK_UNDERFLOW;
-    if (!(bool)vm->stack[vm->sp--]) break;
+    if (!(bool)vm->stack[--vm->sp]) break;
     vm->ip += inst.operand;
     return VM_ERR_NONE;
   };
 
+  case INST_LOAD: {
+    if (vm->sp < 1) return VM_ERR_STACK_UNDERFLOW;
+    const Value addr = vm->stack[vm->sp - 1];
+    if (!_vm_mem_in_bounds(vm, addr, 1)) return VM_ERR_MEMORY_OUT_OF_BOUNDS;
+    vm->stack[vm->sp - 1] = vm->memory[addr];
+  } break;
+
+  case INST_STORE: {
+    if (vm->sp < 2) return VM_ERR_STACK_UNDERFLOW;
+    const Value addr = vm->stack[vm->sp - 1];
+    if (!_vm_mem_in_bounds(vm, addr, 1)) return VM_ERR_MEMORY_OUT_OF_BOUNDS;
+    vm->memory[addr] = vm->stack[vm->sp - 2];
+    vm->sp -= 2;
+  } break;
+
+  case INST_MEMCPY: {
+    if (vm->sp < 3) return VM_ERR_STACK_UNDERFLOW;
+    const Value count = vm->stack[vm->sp - 1];
+    const Value src = vm->stack[vm->sp - 2];
+    const Value dst = vm->stack[vm->sp - 3];
+    if (!_vm_mem_in_bounds(vm, src, count) ||
+        !_vm_mem_in_bounds(vm, dst, count)) return VM_ERR_MEMORY_OUT_OF_BOUNDS;
+    (void)memmove(vm->memory + dst, vm->memory + src, sizeof(Value) * count);
+    vm->sp -= 3;
+  } break;
+
+  case INST_MEMSET: {
+    if (vm->sp < 3) return VM_ERR_STACK_UNDERFLOW;
+    const Value count = vm->stack[vm->sp - 1];
+    const Value value = vm->stack[vm->sp - 2];
+    const Value dst = vm->stack[vm->sp - 3];
+    if (!_vm_mem_in_bounds(vm, dst, count)) return VM_ERR_MEMORY_OUT_OF_BOUNDS;
+    for (Value *cell = vm->memory + dst; cell != vm->memory + dst + count; cell++)
+      *cell = value;
+    vm->sp -= 3;
+  } break;
+
+  case INST_CALL: {
+    if (vm->rsp >= VM_RSTACK_CAPACITY) return VM_ERR_RSTACK_OVERFLOW;
+    vm->rstack[vm->rsp++] = vm->ip + 1;
+    vm->ip += inst.operand;
+  } return VM_ERR_NONE;
+
+  case INST_RET: {
+    if (vm->rsp == 0) return VM_ERR_RSTACK_UNDERFLOW;
+    vm->ip = vm->rstack[--vm->rsp];
+  } return VM_ERR_NONE;
+
+  case INST_SPAWN: {
+    if (vm->sp < 1) return VM_ERR_STACK_UNDERFLOW;
+    const size_t argc = vm->stack[vm->sp - 1];
+    if (argc >= vm->sp) return VM_ERR_STACK_UNDERFLOW;
+    size_t handle = 0;
+    while (handle < VM_CHILDREN_CAPACITY && vm->children[handle] != NULL) handle++;
+    if (handle == VM_CHILDREN_CAPACITY) return VM_ERR_TOO_MANY_CHILDREN;
+    vm->sp -= argc + 1;
+    vm->children[handle] = pool_spawn(vm, vm->ip + inst.operand, vm->stack + vm->sp, argc);
+    vm->stack[vm->sp++] = handle;
+  } break;
+
+  case INST_JOIN: {
+    if (vm->sp < 1) return VM_ERR_STACK_UNDERFLOW;
+    const Value handle = vm->stack[vm->sp - 1];
+    if ((uint64_t)handle >= VM_CHILDREN_CAPACITY || vm->children[handle] == NULL)
+      return VM_ERR_INVALID_HANDLE;
+    struct Task *child = vm->children[handle];
+    vm->children[handle] = NULL;
+    vm->sp--;
+    vm_err_t result = pool_join(vm->pool, child, vm);
+    if (result != VM_ERR_NONE) return result;
+  } break;
+
   case INST_HALT: {
     vm->halted = true;
   } break;
@@ -91,9 +222,35 @@ vm_err_t vm_exec(VM *vm, Inst inst)
 
 #undef __binop
 
+// Takes the next slice of the shared budget, or fails once it is spent.
+static bool _vm_refuel(VM *vm)
+{
+  uint64_t left = atomic_load_explicit(vm->budget, memory_order_relaxed);
+  uint64_t slice;
+  do {
+    if (left == 0) return false;
+    slice = left < VM_BUDGET_SLICE ? left : VM_BUDGET_SLICE;
+  } while (!atomic_compare_exchange_weak_explicit(vm->budget, &left, left - slice,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed));
+  vm->fuel = slice;
+  return true;
+}
+
 vm_err_t vm_run(VM *vm)
 {
+  if (vm->budget == NULL) {
+    while (!vm->halted) {
+      if (vm->ip >= vm->count) return VM_ERR_IP_OUT_OF_BOUNDS;
+      vm_err_t result = vm_exec(vm, vm->code[vm->ip]);
+      if (result != VM_ERR_NONE) return result;
+    }
+    return VM_ERR_NONE;
+  }
   while (!vm->halted) {
+    if (vm->ip >= vm->count) return VM_ERR_IP_OUT_OF_BOUNDS;
+    if (vm->fuel == 0 && !_vm_refuel(vm)) return VM_ERR_BUDGET_EXHAUSTED;
+    vm->fuel--;
     vm_err_t result = vm_exec(vm, vm->code[vm->ip]);
     if (result != VM_ERR_NONE) return result;
   }
@@ -1,14 +1,20 @@
 #ifndef VM_H
 #define VM_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
 #define VM_STACK_CAPACITY 1024
+#define VM_RSTACK_CAPACITY 256
+#define VM_CHILDREN_CAPACITY 64
+// Instructions a VM takes from a shared budget at a time.
+#define VM_BUDGET_SLICE 4096
 
 typedef int64_t Value;
 
+#define inst_nop         (Inst){INST_NOP, 0}
 #define inst_push(value) (Inst){INST_PUSH,(value)}
 #define inst_dup(value)  (Inst){INST_DUP, (value)}
 #define inst_add         (Inst){INST_ADD, 0}
@@ -19,6 +25,14 @@ typedef int64_t Value;
 #define inst_jmp(value)  (Inst){INST_JMP,(value)}
 #define inst_jz(value)   (Inst){INST_JZ,(value)}
 #define inst_jnz(value)  (Inst){INST_JNZ,(value)}
+#define inst_load        (Inst){INST_LOAD, 0}
+#define inst_store       (Inst){INST_STORE, 0}
+#define inst_memcpy      (Inst){INST_MEMCPY, 0}
+#define inst_memset      (Inst){INST_MEMSET, 0}
+#define inst_call(value) (Inst){INST_CALL,(value)}
+#define inst_ret         (Inst){INST_RET, 0}
+#define inst_spawn(value) (Inst){INST_SPAWN,(value)}
+#define inst_join        (Inst){INST_JOIN, 0}
 #define inst_halt        (Inst){INST_HALT, 0}
 
 typedef enum {
@@ -33,6 +47,14 @@ typedef enum {
   INST_JMP,
   INST_JZ,
   INST_JNZ,
+  INST_LOAD,   // ( addr -- value )
+  INST_STORE,  // ( value addr -- )
+  INST_MEMCPY, // ( dst src count -- )
+  INST_MEMSET, // ( dst value count -- )
+  INST_CALL,
+  INST_RET,
+  INST_SPAWN,  // ( values... count -- handle )
+  INST_JOIN,   // ( handle -- results... )
   INST_HALT = 255,
 } inst_t;
 
@@ -41,11 +63,25 @@ typedef struct {
   Value operand;
 } Inst;
 
+struct Pool;
+struct Task;
+
 typedef struct {
   Inst *code;
+  size_t count; // instructions in `code`, which `ip` must stay below
   size_t ip;
   Value stack[VM_STACK_CAPACITY];
   size_t sp;
+  size_t rstack[VM_RSTACK_CAPACITY]; // return addresses, kept apart from `stack`
+  size_t rsp;
+  Value *memory; // linear memory, addressed in `Value`s
+  size_t memory_size;
+  struct Pool *pool; // runs spawned children, inline if NULL
+  struct Task *children[VM_CHILDREN_CAPACITY]; // indexed by spawn handle
+  // Instructions this VM and its children may still run between them, or
+  // NULL for no limit. Each VM takes them a slice at a time into `fuel`.
+  _Atomic uint64_t *budget;
+  uint64_t fuel;
   bool halted;
 } VM;
 
@@ -54,14 +90,187 @@ typedef enum {
   VM_ERR_STACK_UNDERFLOW,
   VM_ERR_STACK_OVERFLOW,
   VM_ERR_ILLEGAL_INST,
+  VM_ERR_MEMORY_OUT_OF_BOUNDS,
+  VM_ERR_RSTACK_UNDERFLOW,
+  VM_ERR_RSTACK_OVERFLOW,
+  VM_ERR_TOO_MANY_CHILDREN,
+  VM_ERR_INVALID_HANDLE,
+  VM_ERR_IP_OUT_OF_BOUNDS,
+  VM_ERR_BUDGET_EXHAUSTED,
 } vm_err_t;
 
 const char* vm_err_to_cstr(vm_err_t error);
 
-extern const bool VM_INST_HAS_OP[255];
+extern const bool VM_INST_HAS_OP[256];
 
 void dump_stack(VM *vm);
 vm_err_t vm_exec(VM *vm, Inst);
 vm_err_t vm_run(VM *vm);
 
 #endif
+
+// Every header includes this one, so its tests are guarded like test.h's
+// implementation.
+#if defined(_TEST_IMPL) && !defined(_VM_TESTS)
+#define _VM_TESTS
+#include "test.h"
+
+static vm_err_t _vm_run_code(Inst *code, size_t count, Value *memory,
+                             size_t memory_size, VM *vm)
+{
+  *vm = (VM){.code = code, .count = count, .memory = memory, .memory_size = memory_size};
+  return vm_run(vm);
+}
+
+// `code` is an array.
+#define _vm_run_on(code, memory, memory_size, vm) \
+  _vm_run_code(code, sizeof code / sizeof code[0], memory, memory_size, vm)
+
+#define _assert_stack(vm, ...)                                        \
+  do {                                                                \
+    const Value expected_[] = {__VA_ARGS__};                          \
+    t_asserteq((vm).sp, sizeof expected_ / sizeof(Value));            \
+    for (size_t i_ = 0; i_ < (vm).sp; i_++)                           \
+      t_asserteq((vm).stack[i_], expected_[i_]);                      \
+  } while (0)
+
+test(vm_load_store) {
+  Value memory[4] = {10, 20, 30, 40};
+  Inst code[] = {
+    inst_push(42), inst_push(3), inst_store,
+    inst_push(3), inst_load, inst_push(0), inst_load, inst_halt,
+  };
+  static VM vm;
+  t_asserteq(_vm_run_on(code, memory, 4, &vm), VM_ERR_NONE);
+  _assert_stack(vm, 42, 10);
+  t_asserteq(memory[3], 42);
+}
+
+test(vm_load_store_out_of_bounds) {
+  Value memory[4] = {0};
+  static VM vm;
+  // The last cell, one past it, a negative address and no memory at all.
+  Inst last[] = { inst_push(3), inst_load, inst_halt };
+  t_asserteq(_vm_run_on(last, memory, 4, &vm), VM_ERR_NONE);
+  Inst past[] = { inst_push(4), inst_load, inst_halt };
+  t_asserteq(_vm_run_on(past, memory, 4, &vm), VM_ERR_MEMORY_OUT_OF_BOUNDS);
+  _assert_stack(vm, 4);
+  Inst negative[] = { inst_push(1), inst_push(-1), inst_store, inst_halt };
+  t_asserteq(_vm_run_on(negative, memory, 4, &vm), VM_ERR_MEMORY_OUT_OF_BOUNDS);
+  _assert_stack(vm, 1, -1);
+  Inst none[] = { inst_push(0), inst_load, inst_halt };
+  t_asserteq(_vm_run_on(none, NULL, 0, &vm), VM_ERR_MEMORY_OUT_OF_BOUNDS);
+  Inst underflow[] = { inst_push(0), inst_store, inst_halt };
+  t_asserteq(_vm_run_on(underflow, memory, 4, &vm), VM_ERR_STACK_UNDERFLOW);
+}
+
+test(vm_memcpy_overlapping) {
+  static VM vm;
+  // dst src count: forwards and backwards over themselves, like memmove.
+  Value forward[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  Inst up[] = { inst_push(2), inst_push(0), inst_push(5), inst_memcpy, inst_halt };
+  t_asserteq(_vm_run_on(up, forward, 8, &vm), VM_ERR_NONE);
+  t_asserteq(vm.sp, 0);
+  const Value up_expected[8] = {1, 2, 1, 2, 3, 4, 5, 8};
+  for (size_t i = 0; i < 8; i++) t_asserteq(forward[i], up_expected[i]);
+
+  Value backward[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  Inst down[] = { inst_push(0), inst_push(2), inst_push(5), inst_memcpy, inst_halt };
+  t_asserteq(_vm_run_on(down, backward, 8, &vm), VM_ERR_NONE);
+  const Value down_expected[8] = {3, 4, 5, 6, 7, 6, 7, 8};
+  for (size_t i = 0; i < 8; i++) t_asserteq(backward[i], down_expected[i]);
+}
+
+test(vm_memcpy_memset_bounds) {
+  static VM vm;
+  Value memory[8] = {0};
+  // Nothing at all is copied right at the end of memory.
+  Inst empty[] = { inst_push(8), inst_push(8), inst_push(0), inst_memcpy, inst_halt };
+  t_asserteq(_vm_run_on(empty, memory, 8, &vm), VM_ERR_NONE);
+
+  const Value bad[][3] = {
+    {0, 4, 5},          // source runs off the end
+    {4, 0, 5},          // destination runs off the end
+    {0, 0, 9},          // more than all of memory
+    {0, 0, -1},         // negative count
+    {-1, 0, 1},         // negative destination
+    {0, -8, 8},         // negative source
+    {INT64_MAX, 0, 2},  // wraps around
+  };
+  for (size_t i = 0; i < sizeof bad / sizeof bad[0]; i++) {
+    Inst copy[] = {
+      inst_push(bad[i][0]), inst_push(bad[i][1]), inst_push(bad[i][2]),
+      inst_memcpy, inst_halt,
+    };
+    t_asserteq(_vm_run_on(copy, memory, 8, &vm), VM_ERR_MEMORY_OUT_OF_BOUNDS);
+    _assert_stack(vm, bad[i][0], bad[i][1], bad[i][2]);
+  }
+
+  // dst value count
+  Inst set[] = { inst_push(2), inst_push(9), inst_push(3), inst_memset, inst_halt };
+  t_asserteq(_vm_run_on(set, memory, 8, &vm), VM_ERR_NONE);
+  t_asserteq(vm.sp, 0);
+  const Value set_expected[8] = {0, 0, 9, 9, 9, 0, 0, 0};
+  for (size_t i = 0; i < 8; i++) t_asserteq(memory[i], set_expected[i]);
+  Inst set_past[] = { inst_push(6), inst_push(1), inst_push(3), inst_memset, inst_halt };
+  t_asserteq(_vm_run_on(set_past, memory, 8, &vm), VM_ERR_MEMORY_OUT_OF_BOUNDS);
+  Inst set_negative[] = { inst_push(2), inst_push(1), inst_push(-2), inst_memset, inst_halt };
+  t_asserteq(_vm_run_on(set_negative, memory, 8, &vm), VM_ERR_MEMORY_OUT_OF_BOUNDS);
+  for (size_t i = 0; i < 8; i++) t_asserteq(memory[i], set_expected[i]);
+  Inst underflow[] = { inst_push(0), inst_push(0), inst_memset, inst_halt };
+  t_asserteq(_vm_run_on(underflow, memory, 8, &vm), VM_ERR_STACK_UNDERFLOW);
+}
+
+test(vm_return_stack) {
+  static VM vm;
+  Inst ret[] = { inst_push(1), inst_ret, inst_halt };
+  t_asserteq(_vm_run_on(ret, NULL, 0, &vm), VM_ERR_RSTACK_UNDERFLOW);
+  _assert_stack(vm, 1);
+  // Recurses until the return stack is full; the value stack is untouched.
+  Inst recurse[] = { inst_call(0), inst_halt };
+  t_asserteq(_vm_run_on(recurse, NULL, 0, &vm), VM_ERR_RSTACK_OVERFLOW);
+  t_asserteq(vm.rsp, VM_RSTACK_CAPACITY);
+  t_asserteq(vm.sp, 0);
+  // One call and its return leave the return stack as it was.
+  Inst call[] = { inst_call(2), inst_halt, inst_push(3), inst_ret };
+  t_asserteq(_vm_run_on(call, NULL, 0, &vm), VM_ERR_NONE);
+  t_asserteq(vm.rsp, 0);
+  _assert_stack(vm, 3);
+}
+
+test(vm_ip_out_of_bounds) {
+  static VM vm;
+  Inst far[] = { inst_jmp((Value)1 << 40), inst_halt };
+  t_asserteq(_vm_run_on(far, NULL, 0, &vm), VM_ERR_IP_OUT_OF_BOUNDS);
+  Inst back[] = { inst_jmp(-1), inst_halt };
+  t_asserteq(_vm_run_on(back, NULL, 0, &vm), VM_ERR_IP_OUT_OF_BOUNDS);
+  // Falls off the end without a halt, and has no code at all.
+  Inst open[] = { inst_push(1), inst_push(2) };
+  t_asserteq(_vm_run_on(open, NULL, 0, &vm), VM_ERR_IP_OUT_OF_BOUNDS);
+  _assert_stack(vm, 1, 2);
+  t_asserteq(_vm_run_code(open, 0, NULL, 0, &vm), VM_ERR_IP_OUT_OF_BOUNDS);
+}
+
+test(vm_budget) {
+  static VM vm;
+  _Atomic uint64_t budget = 3 * VM_BUDGET_SLICE + 5;
+  Inst spin[] = { inst_jmp(0) };
+  vm = (VM){.code = spin, .count = 1, .budget = &budget};
+  t_asserteq(vm_run(&vm), VM_ERR_BUDGET_EXHAUSTED);
+  t_asserteq(atomic_load(&budget), 0);
+
+  // A spawned child draws on the same budget as its parent.
+  Inst spawn[] = { inst_push(0), inst_spawn(3), inst_join, inst_halt, inst_jmp(0) };
+  budget = 100;
+  vm = (VM){.code = spawn, .count = 5, .budget = &budget};
+  t_asserteq(vm_run(&vm), VM_ERR_BUDGET_EXHAUSTED);
+  t_asserteq(atomic_load(&budget), 0);
+
+  // Enough to finish, with what is left over still in the budget.
+  Inst done[] = { inst_push(1), inst_halt };
+  budget = 10;
+  vm = (VM){.code = done, .count = 2, .budget = &budget};
+  t_asserteq(vm_run(&vm), VM_ERR_NONE);
+  t_asserteq(atomic_load(&budget) + vm.fuel, 8);
+}
+#endif